@@ -5,8 +5,33 @@
  * Usage: take a look at `struct sjson`, it represents a json value
  * Notes: object and array children are stored as linked list,
  *        this is for simplicity and predictable memory usage
- *        if you are going to do a lot of children lookup,
- *        you should iterate over them yourself or use different library
+ *        objects with SJSON_INDEX_MIN or more children get a hash
+ *        index the first time sjson_object_get() looks into them,
+ *        arrays a child vector on first sjson_array_get() / _set()
+ *
+ *        sjson_deserialize_arena() puts a whole document in one
+ *        sjson_arena, releasing it is a single sjson_arena_free()
+ *
+ *        SJSON_OPT_LAZY defers building containers until accessed,
+ *        sjson_query_find() goes to one path without any tree at all
+ *
+ *        sjson_tape is a flat, mmap-able form of a whole document,
+ *        sjson_compact a read-only tree of 16 byte nodes
+ *
+ *        sjson_pull parses input that arrives in chunks without
+ *        building a tree, one event per sjson_pull_next()
+ *
+ *        sjson_deserialize_lines() parses NDJSON on a thread pool,
+ *        sjson_deserialize_parallel() the elements of a top-level
+ *        array, link with -pthread or define SJSON_NO_THREADS
+ *
+ *        sjson_deserialize_file() parses from an mmap of the file,
+ *        with SJSON_OPT_ZEROCOPY strings point into the mapping
+ *
+ *        sjson_writer emits json call by call, no tree in between
+ *
+ *        sjson_msgpack_encode() / _decode() convert trees to and from
+ *        MessagePack
  *
  * Example:
  *        look at test/test.c, describe(json)
@@ -14,6 +39,14 @@
  * v0.0.3 - sleepntsheep 2022
  */
 
+/* -std=c99 / -std=c11 hide POSIX from the system headers, the
+ * implementation needs it for posix_madvise. If system headers are
+ * included before this one, define _POSIX_C_SOURCE 200112L yourself */
+#if defined(SHEEP_SJSON_IMPLEMENTATION) && defined(__STRICT_ANSI__) &&       \
+    !defined(_POSIX_C_SOURCE) && !defined(_GNU_SOURCE) && !defined(__APPLE__)
+#define _POSIX_C_SOURCE 200112L
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -22,6 +55,7 @@ extern "C" {
 #define SHEEP_SJSON_H
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #define SJSON_TYPES_LIST                                                       \
@@ -46,7 +80,9 @@ extern "C" {
         SJSON_X(SJSON_ERR_NO_TERMINATING_DOUBLE_QUOTE),                        \
         SJSON_X(SJSON_ERR_INVALID_SOURCE),                                     \
         SJSON_X(SJSON_ERR_INVALID_ESCAPE_SEQUENCE),                            \
-        SJSON_X(SJSON_ERR_NULL_REFERENCE),
+        SJSON_X(SJSON_ERR_NULL_REFERENCE), SJSON_X(SJSON_ERR_WRITE),          \
+        SJSON_X(SJSON_ERR_NEED_INPUT), SJSON_X(SJSON_ERR_READ),            \
+        SJSON_X(SJSON_ERR_INVALID_UTF8), SJSON_X(SJSON_ERR_MAX_DEPTH),
 
 #define SJSON_X(a) a
 enum sjson_type { SJSON_TYPES_LIST };
@@ -59,7 +95,64 @@ static const char *sjson_err_names[] = {SJSON_ERR_LIST};
 static const char *sjson_token_names[] = {SJSON_TOKENS_LIST};
 #undef SJSON_X
 
+/* objects with this many children get a hash index on lookup */
+#ifndef SJSON_INDEX_MIN
+#define SJSON_INDEX_MIN 16
+#endif /* SJSON_INDEX_MIN */
+
+/* default nesting limit of parsers, see sjson_options.max_depth */
+#ifndef SJSON_MAX_DEPTH
+#define SJSON_MAX_DEPTH 1024
+#endif /* SJSON_MAX_DEPTH */
+
+#ifndef SJSON_WRITE_CHUNK
+#define SJSON_WRITE_CHUNK 4096
+#endif /* SJSON_WRITE_CHUNK */
+
+#if defined(__unix__) || defined(__APPLE__)
+#define SJSON_HAVE_FD
+#endif
+
+/* parallel entry points use pthreads unless SJSON_NO_THREADS is defined */
+#if defined(SJSON_HAVE_FD) && !defined(SJSON_NO_THREADS)
+#define SJSON_HAVE_THREADS
+#endif
+
+/* inputs are not split among more threads than this many bytes each */
+#ifndef SJSON_THREAD_MIN
+#define SJSON_THREAD_MIN 65536
+#endif /* SJSON_THREAD_MIN */
+
 typedef enum SjsonResult sjson_resultnum;
+typedef enum SjsonResult SjsonResult;
+
+/** sjson.flags: node memory belongs to an sjson_arena */
+#define SJSON_FLAG_ARENA 0x1
+/** sjson.flags: v.str / key was malloced by sjson and is freed with node */
+#define SJSON_FLAG_OWNSTR 0x2
+#define SJSON_FLAG_OWNKEY 0x4
+/** sjson.flags: x.len / keylen are valid, string may not be terminated */
+#define SJSON_FLAG_STRLEN 0x8
+#define SJSON_FLAG_KEYLEN 0x10
+/** sjson.flags: number is an integer, x.i holds it exactly, v.num rounded */
+#define SJSON_FLAG_INT 0x20
+/** sjson.flags: container not expanded yet, v.str / x.len is its source */
+#define SJSON_FLAG_LAZY 0x40
+/** sjson.flags: container was written by sjson_serialize_cached, its
+ * place in that output is kept in its index, see sjson_touch */
+#define SJSON_FLAG_CACHED 0x80
+/** sjson.flags: cached container changed since, its bytes are stale */
+#define SJSON_FLAG_DIRTY 0x100
+
+/** sjson_options.flags: strings without escapes point into the source */
+#define SJSON_OPT_ZEROCOPY 0x1
+/** sjson_options.flags: build children of containers on first access */
+#define SJSON_OPT_LAZY 0x2
+/** sjson_options.flags: reject strings that are not valid UTF-8 */
+#define SJSON_OPT_VALIDATE_UTF8 0x4
+
+/** sjson_escape flags: escape non-ASCII characters too */
+#define SJSON_ESCAPE_ASCII 0x1
 
 /**
  * @brief char buffer
@@ -70,58 +163,352 @@ typedef struct sjsonbuf {
     char *buf;  /** buffer */
 } sjsonbuf;
 
-struct sjson_value {
+/**
+ * @brief value of a node, the member in use depends on type
+ *
+ * a lazy container keeps its source in v.str / x.len until expanded,
+ * only then v.child / x.tail are its children
+ */
+union sjson_value {
     double num;          /** number value */
     const char *str;     /** string value */
     struct sjson *child; /** first node in children linked list */
-    struct sjson *tail;  /** last node in children linked list */
 };
 
 /**
- * @brief struct for representing json
+ * @brief second word of a node's value, by type like sjson_value
+ */
+union sjson_valuex {
+    int64_t i;          /** exact integer value, see SJSON_FLAG_INT */
+    size_t len;         /** length of str, see SJSON_FLAG_STRLEN */
+    struct sjson *tail; /** last node in children linked list */
+};
+
+/**
+ * @brief struct for representing json, 72 bytes on 64-bit targets
  */
 typedef struct sjson {
-    int type;             /** type of json object */
-    struct sjson_value v; /** value of object */
-    struct sjson *next;   /** next sibling object */
-    struct sjson *prev;   /** previous sibling object */
-    const char *key;      /** key of object, if any */
+    int type;                 /** type of json object */
+    int flags;                /** private: SJSON_FLAG_* bits */
+    union sjson_value v;      /** value of object */
+    union sjson_valuex x;     /** rest of value of object */
+    struct sjsonindex *index; /** private: lookup index, see SJSON_INDEX_MIN */
+    struct sjson *next;       /** next sibling object */
+    struct sjson *prev;       /** previous sibling object */
+    struct sjson *parent;     /** containing object or array, NULL for root */
+    const char *key;          /** key of object, if any */
+    size_t keylen;            /** length of key, see SJSON_FLAG_KEYLEN */
 } sjson;
 
 typedef struct {
-    sjson *json; /** json object */
-    int err;     /** SJSON_SUCCESS (0) if no err, else non-zero */
+    sjson *json;     /** json object */
+    SjsonResult err; /** SJSON_SUCCESS (0) if no err, else non-zero */
 } sjson_result;
 
+/**
+ * @brief arena allocator owning every node and string of a document
+ *
+ * memory is carved out of a chain of blocks that double in size,
+ * zero-initialize it (sjson_arena arena = {0};) before first use.
+ * nodes allocated from an arena are never freed one by one,
+ * sjson_free() on them is a no-op, call sjson_arena_free() to
+ * release the whole document at once
+ */
+typedef struct sjson_arena {
+    struct sjsonarenablock *head; /** private: most recent block */
+} sjson_arena;
+
+/**
+ * private: index of a large object's or array's children
+ *
+ * objects get a hash table of children by key, arrays a vector of
+ * children by position, built the first time a container with at least
+ * SJSON_INDEX_MIN children is accessed, then kept in sync by
+ * sjson_addchild / sjson_deletechild / sjson_array_set, so children must
+ * not be relinked or rekeyed by hand once it exists.
+ * arena containers only get one when the parser finds them large enough.
+ * it also keeps where sjson_serialize_cached last wrote the container
+ */
+typedef struct sjsonindex {
+    sjson_arena *arena;       /** tables come from here if not NULL */
+    struct sjsonslot *slots;  /** open addressing table, NULL if not built */
+    size_t cap, len;          /** slots capacity (power of two), used */
+    size_t dups;              /** children shadowed by same-key child */
+    struct sjson **items;     /** array children in order, NULL if not built */
+    size_t nitems, itemscap;  /** items length, capacity */
+    size_t cacheat, cachelen; /** sjson_serialize_cached output: offset
+                                  from parent's, length, see
+                                  SJSON_FLAG_CACHED */
+} sjsonindex;
+
+/**
+ * @brief table of distinct object keys, shared by any number of documents
+ *
+ * zero-initialize before first use, it must outlive every document
+ * deserialized with it, and is not thread-safe
+ */
+typedef struct sjson_intern {
+    struct sjsoninternslot *slots; /** private: open addressing table */
+    size_t cap, len;               /** private: slots capacity, used */
+    sjson_arena arena;             /** private: storage of keys */
+} sjson_intern;
+
+/**
+ * @brief deserialization options, zero-initialize for defaults
+ *
+ * with SJSON_OPT_ZEROCOPY, string values and keys that contain no escape
+ * sequence are (pointer, length) slices into the source instead of
+ * copies, they are not NUL-terminated so x.len and keylen must be used,
+ * the source must outlive the document
+ *
+ * with SJSON_OPT_LAZY, which implies SJSON_OPT_ZEROCOPY, an object or
+ * array only records its source span, its children are parsed the first
+ * time sjson_object_get / sjson_array_get / ... reach into it, one level
+ * at a time, subtrees never reached are skipped by bracket matching and
+ * cost nothing but their parent's node. syntax errors inside a subtree
+ * surface when it is expanded, see sjson_expand
+ *
+ * with SJSON_OPT_VALIDATE_UTF8, a string or key that is not valid UTF-8
+ * fails with SJSON_ERR_INVALID_UTF8, bytes >= 0x80 can only appear in
+ * strings so this validates the whole source, only strings that have
+ * such bytes are looked at twice. lazy documents are validated as a
+ * whole up front. escapes are not checked, a lone \\uXXXX surrogate
+ * decodes to U+FFFD
+ *
+ * with an intern table every key is stored once in it and shared by all
+ * documents, sjson_object_get compares such keys by pointer first, so
+ * pass it keys returned by sjson_intern_key. lazily expanded containers
+ * and sjson_deserialize_lines do not intern
+ *
+ * parsing takes no call stack per nesting level, containers nested more
+ * than max_depth deep fail with SJSON_ERR_MAX_DEPTH instead, lazily
+ * expanded containers count from where they were expanded
+ */
+typedef struct sjson_options {
+    int flags;             /** SJSON_OPT_* bits */
+    sjson_arena *arena;    /** allocate document here if not NULL */
+    sjson_intern *intern;  /** intern keys here if not NULL */
+    size_t max_depth;      /** nesting limit, 0 for SJSON_MAX_DEPTH */
+} sjson_options;
+
+/**
+ * @brief context for parsing many documents in a row, see
+ * sjson_parser_parse
+ *
+ * zero-initialize before first use and set opt as needed, opt.arena is
+ * not used, documents go to the context's own arena
+ */
+typedef struct sjson_parser {
+    sjson_options opt;  /** options of every parse */
+    sjson_arena arena;  /** private: holds the current document */
+} sjson_parser;
+
+/**
+ * @brief structural index of a json source (stage 1)
+ *
+ * source offsets, in order, of every {}[]:, outside strings, of every
+ * opening double quote and of the first byte of every other scalar,
+ * reusable across calls, sources are limited to 4 GiB
+ */
+typedef struct sjson_structural {
+    uint32_t *pos; /** offsets into source */
+    size_t len;    /** number of offsets */
+    size_t cap;    /** private: capacity of pos */
+} sjson_structural;
+
+/**
+ * @brief output callback of sjson_serialize_to
+ * @return 0 if all len bytes of data were written, else non-zero
+ */
+typedef int (*sjson_writefn)(void *ctx, const char *data, size_t len);
+
 typedef struct sjsontok {
     int type;
     const char *start;
     const char *end;
+    double num; /** value of number literal */
+    int64_t i;  /** value of number literal if isint */
+    bool isint; /** number literal is an integer exact in int64_t */
 } sjsontok;
 
-typedef struct sjsontokarr {
-    size_t length, capacity;
-    size_t cur;
-    sjsontok *a;
-} sjsontokarr;
-
 typedef struct sjsonlexer {
     const char *start, *end, *c;
-    sjsontokarr toks;
+    sjson_arena *arena;   /** nodes and strings go here if not NULL */
+    int flags;            /** SJSON_OPT_* bits */
+    sjson_intern *intern; /** keys go here if not NULL */
+    size_t maxdepth;      /** containers may nest this deep */
+    sjson_arena *home;    /** arena index stubs point to, arena if NULL */
 } sjsonlexer;
 
+/* lexer and parser are fused, the parser pulls one token at a time */
 typedef struct sjsonparser {
-    size_t i;
-    sjsontokarr toks;
+    sjsonlexer lexer;
+    sjsontok tok; /** current token */
 } sjsonparser;
 
+/**
+ * @brief event of sjson_pull_next
+ *
+ * tok.type is SJSON_TKLBRACE / SJSON_TKRBRACE at start / end of an object,
+ * SJSON_TKLSQUAREBRACKET / SJSON_TKRSQUAREBRACKET at start / end of an
+ * array, SJSON_TKSTRINGLITERAL, SJSON_TKNUMBERLITERAL, SJSON_TKTRUE,
+ * SJSON_TKFALSE or SJSON_TKNULL for a key or value, and SJSON_TKINVALID
+ * once the document is complete. strings are decoded in
+ * [tok.start, tok.end), not NUL-terminated, valid until the next call
+ */
+typedef struct sjson_event {
+    sjsontok tok; /** kind, span and number value of the event */
+    bool iskey;   /** string is an object key, not a value */
+} sjson_event;
+
+/**
+ * @brief incremental pull parser, zero-initialize before first use
+ *
+ * input arrives in chunks of any size through sjson_pull_feed, a token
+ * split across chunks is carried over to the next one, so memory use is
+ * bounded by nesting depth and longest token, not by document size
+ */
+typedef struct sjson_pull {
+    const char *c, *end; /** private: unread part of current chunk */
+    bool last;           /** private: current chunk ends the input */
+    bool escape;         /** private: pending string ends in a backslash */
+    int state;           /** private: what may come next */
+    sjsonbuf pending;    /** private: head of token split across chunks */
+    sjsonbuf str;        /** private: decoded string of last event */
+    char *stack;         /** private: '{' or '[' per open container */
+    size_t depth, stackcap;
+    size_t max_depth;    /** nesting limit, 0 for SJSON_MAX_DEPTH */
+} sjson_pull;
+
+/**
+ * @brief writer emitting json straight into a buffer, no tree needed
+ *
+ * zero-initialize, then call sjson_writer_begin_object, _key, _string,
+ * ... in document order, escaping and number formatting are those of
+ * sjson_serialize. calls out of place (a value where a key is due, a key
+ * outside an object, an unmatched end, a second top-level value) fail
+ * with SJSON_ERR_WRONG_TYPE
+ */
+typedef struct sjson_writer {
+    sjsonbuf buf;    /** output so far, NUL-terminated */
+    SjsonResult err; /** first error, nothing is written after it */
+    bool comma;      /** private: a comma goes before next key or value */
+    bool key;        /** private: key written, its value is next */
+    char *stack;     /** private: '{' or '[' per open container */
+    size_t depth, stackcap;
+} sjson_writer;
+
+/**
+ * @brief records of a newline-delimited json buffer, see
+ * sjson_deserialize_lines
+ */
+typedef struct sjson_batch {
+    sjson_result *records; /** one per non-blank line, in input order */
+    size_t len;            /** number of records */
+    sjson_arena *arenas;   /** private: one arena per worker thread */
+    size_t narenas;
+} sjson_batch;
+
+/**
+ * @brief source of a document read by sjson_deserialize_file
+ *
+ * holds the file mapping (or copy, where mmap is unavailable) that
+ * SJSON_OPT_ZEROCOPY strings and SJSON_OPT_LAZY containers point into,
+ * empty otherwise
+ */
+typedef struct sjson_file {
+    const char *data; /** file contents */
+    size_t len;       /** length of data */
+    bool mapped;      /** private: data is an mmap, not malloced */
+} sjson_file;
+
+/**
+ * @brief compiled JSON Pointer or dotted path, see sjson_query_compile
+ */
+typedef struct sjson_query {
+    struct sjsonquerystep *steps; /** private: one per path segment */
+    size_t len;                   /** private: number of steps */
+} sjson_query;
+
+/**
+ * @brief document as a flat tape of 64-bit words plus a string arena
+ *
+ * every word is a type byte in its top 8 bits and a 56 bit payload:
+ * '{' / '[' payload is index past the matching close in its low 32 bits
+ * and the child count (saturated at 0xffffff) above, '}' / ']' payload
+ * is index of the matching open, 'k' (object key) / '"' (string) payload
+ * is offset of a uint32_t length, the bytes and a NUL in strings,
+ * 'l' / 'd' are followed by a word holding the int64_t / double, 't',
+ * 'f', 'n' have no payload. an object's children are key, value pairs.
+ * values are referred to by their word index, the root is at 0.
+ * a tape written by sjson_tape_write is read back by sjson_tape_open
+ * with a single mmap, nothing is parsed, only the header is checked,
+ * so only open files that sjson_tape_write wrote on the same platform
+ */
+typedef struct sjson_tape {
+    const uint64_t *words; /** tape */
+    size_t len;            /** number of words */
+    const char *strings;   /** string arena */
+    size_t strlen;         /** bytes in strings */
+    sjson_file file;       /** private: backing file, see sjson_tape_open */
+} sjson_tape;
+
+/**
+ * @brief iterate through children of tape container value v,
+ * iter is the word index of each child value
+ */
+#define sjson_tape_foreach(tape, v, iter)                                      \
+    for (size_t iter = sjson_tape_first((tape), (v)); (iter) != 0;             \
+         iter = sjson_tape_next((tape), (iter)))
+
+/**
+ * @brief compact 16 byte node, see sjson_compact_deserialize
+ *
+ * scalars are stored inline, the children of a container are one
+ * contiguous block, an object's as key, value pairs with the key a
+ * SJSON_STRING node, so the tree is read-only once built
+ */
+typedef struct sjson_compact {
+    uint16_t type;  /** SJSON_* type */
+    uint16_t flags; /** SJSON_FLAG_INT if the number is in v.i */
+    uint32_t len;   /** length of string, or number of children */
+    union {
+        double num;                  /** number, unless SJSON_FLAG_INT */
+        int64_t i;                   /** number, if SJSON_FLAG_INT */
+        const char *str;             /** string, see sjson_compact_deserialize */
+        struct sjson_compact *child; /** block of children */
+    } v;
+} sjson_compact;
+
+/**
+ * @brief iterate through all child values of compact container,
+ * in an object iter[-1] is the key of iter
+ */
+#define sjson_compact_foreach(json, iter)                                      \
+    for (sjson_compact *iter =                                                 \
+             (json)->v.child + ((json)->type == SJSON_OBJECT);                 \
+         (json)->len &&                                                        \
+         iter < (json)->v.child +                                              \
+                    (size_t)(json)->len * (1 + ((json)->type == SJSON_OBJECT)); \
+         iter += 1 + ((json)->type == SJSON_OBJECT))
+
+/**
+ * @brief first child of json, NULL unless it is an expanded object or
+ * array, v.child holds something else otherwise
+ */
+#define sjson_child(json)                                                      \
+    (((json)->type == SJSON_OBJECT || (json)->type == SJSON_ARRAY) &&          \
+             !((json)->flags & SJSON_FLAG_LAZY)                                \
+         ? (json)->v.child                                                     \
+         : NULL)
+
 /**
  * @brief iterate through all child of sjson object
  * @param json parent json to iterate over
  * @param iter name of iterator
  */
 #define sjson_foreach(json, iter)                                              \
-    for (sjson *iter = (json)->v.child; (iter) != NULL; iter = (iter)->next)
+    for (sjson *iter = sjson_child(json); (iter) != NULL; iter = (iter)->next)
 
 /**
  * @brief create new sjson object with type
@@ -142,672 +529,4990 @@ void sjson_free(sjson *json);
 sjson_result sjson_deserialize(const char *s, size_t len);
 
 /**
- * @brief serialize sjson * to C-string in sjsonbuf
- * @return buffer holding length, capacity, and pointer to C-string
+ * @brief deserialize C-string to sjson * with options
+ * @param s C-string
+ * @param len length of parameter s
+ * @param opt options, NULL for defaults
  */
-sjsonbuf sjson_serialize(sjson *json);
+sjson_result sjson_deserialize_ex(const char *s, size_t len,
+                                  const sjson_options *opt);
 
-static void sjsonlexer_init(sjsonlexer *lexer, const char *s, size_t len);
-static SjsonResult sjsonlexer_lex(sjsonlexer *lexer);
-static sjson_result sjson_parse(sjsontokarr *toks);
+/**
+ * @brief deserialize with a reusable context, the document replaces the
+ * previous one parsed with it, whose memory is reused
+ * @param parser context, zero-initialized or used before
+ * @param s json source
+ * @param len length of parameter s
+ *
+ * the document lives until the next call or sjson_parser_free, once the
+ * context has held a document as large, parsing allocates nothing
+ */
+sjson_result sjson_parser_parse(sjson_parser *parser, const char *s,
+                                size_t len);
 
 /**
- * @brief get child by index
+ * @brief free memory of parser and its current document
  */
-sjson_result sjson_array_get(sjson *json, size_t i);
+void sjson_parser_free(sjson_parser *parser);
+
 /**
- * @brief replace index-th child of array to json
- * @param json array
- * @param i index of child to replace
- * @param x new child value
+ * @brief deserialize C-string to sjson * allocated in arena
+ * @param arena arena that will own every node and decoded string
+ * @param s C-string
+ * @param len length of parameter s
+ *
+ * the returned tree lives until sjson_arena_free(arena),
+ * several documents may share one arena
  */
-SjsonResult sjson_array_set(sjson *json, size_t i, sjson *x);
+sjson_result sjson_deserialize_arena(sjson_arena *arena, const char *s,
+                                     size_t len);
+
 /**
- * @brief remove i-th child of array
- * @param json array
- * @param i index of child element to remove
+ * @brief deserialize file at path, parsing straight from a read-only
+ * memory mapping of it where mmap is available, advised as sequential
+ * @param path file to read
+ * @param opt options, NULL for defaults
+ * @param file source of the document, with SJSON_OPT_ZEROCOPY or
+ * SJSON_OPT_LAZY it stays mapped for the strings and unexpanded
+ * containers that point into it, else it is already released
+ * @return SJSON_ERR_READ if the file could not be opened or read
+ *
+ * free the document first, then call sjson_file_close(file)
  */
-SjsonResult sjson_array_delete(sjson *json, size_t i);
+sjson_result sjson_deserialize_file(const char *path, const sjson_options *opt,
+                                    sjson_file *file);
+
 /**
- * @brief get first child of object with matching key
- * @param json object
- * @param key key to get
+ * @brief release source of a document read by sjson_deserialize_file
  */
+void sjson_file_close(sjson_file *file);
 
-sjson_result sjson_object_get(sjson *json, char *key);
 /**
- * @brief set key property of object to json
- * @param json object
- * @param key key of new child
- * @param value new child to add
+ * @brief deserialize newline-delimited json (NDJSON, JSON Lines)
+ * @param s buffer of records separated by newlines outside strings
+ * @param len length of parameter s
+ * @param threads worker threads, 0 for one per online core
+ * @param opt options, NULL for defaults, opt->arena is not used
+ * @param batch filled with one result per non-blank line
+ * @return SJSON_ERR_NO_MEMORY if batch could not be built, errors of
+ * single records are reported in their sjson_result
  *
- * This function call sjson_object_delete_all(json, key)
- * before adding child. Causing every prior child having the same key
- * to be deleted
+ * records are parsed in parallel, each worker into its own arena,
+ * all of them are released by sjson_batch_free(batch)
  */
-SjsonResult sjson_object_set(sjson *json, char *key, sjson *value);
+SjsonResult sjson_deserialize_lines(const char *s, size_t len, int threads,
+                                    const sjson_options *opt,
+                                    sjson_batch *batch);
+
 /**
- * @brief delete all child with matching key
- * @param json parent node
- * @param key key to delete
+ * @brief deserialize a document whose top-level value is an array,
+ * parsing slices of its elements on worker threads
+ * @param s json source
+ * @param len length of parameter s
+ * @param threads worker threads, 0 for one per online core
+ * @param opt options, NULL for defaults
+ *
+ * a structural pre-scan cuts the array at top-level commas into slices
+ * of about the same size, each worker parses one slice and the element
+ * lists are joined in order, with opt->arena workers fill arenas of
+ * their own that are then merged into it. any other document, small
+ * ones, SJSON_OPT_LAZY and an intern table get a plain
+ * sjson_deserialize_ex, so does one with a parse error, so it reports
+ * the same error as sjson_deserialize_ex would
  */
-SjsonResult sjson_object_delete_all(sjson *json, char *key);
-// SjsonResult sjson_array_del(sjson *json, char *key, sjson *value);
+sjson_result sjson_deserialize_parallel(const char *s, size_t len,
+                                        int threads,
+                                        const sjson_options *opt);
 
 /**
- * @brief add child to json's children
- * @param json parent node
- * @param child child node
+ * @brief free every record and arena of batch
  */
-SjsonResult sjson_addchild(sjson *json, sjson *child);
+void sjson_batch_free(sjson_batch *batch);
 
 /**
- * @brief delete child from json's children
- * @param json parent node
- * @param child child node
- * @return SJSON_SUCCESS (0) if success, else non-zero
+ * @brief compile path into query, once for any number of sources
+ * @param path JSON Pointer (RFC 6901) if empty or starting with '/',
+ * e.g. "/users/0/name", else dotted path, e.g. "users.0.name"
+ * @param q query to fill, release with sjson_query_free
+ * @return SJSON_ERR_INVALID_ESCAPE_SEQUENCE for a '~' not followed by
+ * '0' or '1' in a JSON Pointer
+ *
+ * all-digit segments index arrays, and match keys in objects
  */
-SjsonResult sjson_deletechild(sjson *json, sjson *child);
+SjsonResult sjson_query_compile(const char *path, sjson_query *q);
 
 /**
- * @brief add element to end of array
- * @param json parent node
- * @param child child node
- * @return SJSON_SUCCESS (0) if success, else non-zero
+ * @brief free steps of q
  */
-#define sjson_array_push sjson_addchild
+void sjson_query_free(sjson_query *q);
 
-#endif /* SHEEP_SJSON_H */
+/**
+ * @brief find value at q in raw json, without building a tree
+ * @param q compiled query
+ * @param s json source
+ * @param len length of parameter s
+ * @param value set to start of matched value in s
+ * @param valuelen set to length of matched value
+ * @return SJSON_ERR_NO_MATCHING_MEMBER if there is no such value,
+ * SJSON_ERR_WRONG_TYPE if the path goes through a scalar
+ *
+ * values not on the path are skipped by bracket matching, not parsed,
+ * so errors in them go unnoticed
+ */
+SjsonResult sjson_query_find(const sjson_query *q, const char *s, size_t len,
+                             const char **value, size_t *valuelen);
 
-#ifdef SHEEP_SJSON_IMPLEMENTATION
+/**
+ * @brief deserialize value at q in raw json, only it is parsed
+ * @param q compiled query
+ * @param s json source
+ * @param len length of parameter s
+ * @param opt options, NULL for defaults
+ */
+sjson_result sjson_query_get(const sjson_query *q, const char *s, size_t len,
+                             const sjson_options *opt);
 
-#include <ctype.h>
-#include <stdint.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
+/**
+ * @brief parse s into a tape, without building sjson nodes
+ * @param s json source
+ * @param len length of parameter s
+ * @param tape tape to fill, release with sjson_tape_free
+ * @return SJSON_ERR_NO_MEMORY also if the tape would not fit the 32-bit
+ * word indexes of its format
+ */
+SjsonResult sjson_tape_build(const char *s, size_t len, sjson_tape *tape);
 
-static sjsontokarr sjsontokarr_new() {
-    return (sjsontokarr){
-        .length = 0,
-        .capacity = 4,
-        .cur = 0,
-        .a = (sjsontok *)malloc(sizeof(sjsontok) * 4),
-    };
-}
+/**
+ * @brief write tape through write, to be read back by sjson_tape_open
+ * @param tape tape
+ * @param write output callback, e.g. sjson_write_file or sjson_write_fd
+ * @param ctx first argument of write
+ * @return SJSON_ERR_WRITE if write failed
+ */
+SjsonResult sjson_tape_write(const sjson_tape *tape, sjson_writefn write,
+                             void *ctx);
 
-static void sjsontokarr_push(sjsontokarr *arr, sjsontok tok) {
-    if (arr->length == arr->capacity)
-        arr->a = (sjsontok *)realloc(arr->a,
-                                     sizeof(sjsontok) * (arr->capacity *= 2));
-    arr->a[arr->length++] = tok;
-}
+/**
+ * @brief map tape file written by sjson_tape_write, nothing is parsed
+ * @param path file to map
+ * @param tape tape to fill, release with sjson_tape_free
+ * @return SJSON_ERR_READ if the file can't be read or is not a tape
+ */
+SjsonResult sjson_tape_open(const char *path, sjson_tape *tape);
 
-static sjsontok sjsontokarr_advance(sjsontokarr *arr) {
-    if (arr->cur < arr->length - 1)
-        return arr->a[arr->cur++];
-    return (sjsontok){0};
-}
+/**
+ * @brief free or unmap tape
+ */
+void sjson_tape_free(sjson_tape *tape);
 
-static sjsontok sjsontokarr_peek(sjsontokarr *arr) { return arr->a[arr->cur]; }
+/**
+ * @brief SJSON_* type of value v of tape
+ */
+int sjson_tape_type(const sjson_tape *tape, size_t v);
 
-static void sjsonlexer_pushtok(sjsonlexer *lexer, int type, const char *start,
-                               const char *end) {
-    sjsontokarr_push(&lexer->toks, (sjsontok){type, start, end});
-}
+/**
+ * @brief string of string value or key v, NUL-terminated
+ * @param len set to length of the string if not NULL
+ */
+const char *sjson_tape_str(const sjson_tape *tape, size_t v, size_t *len);
 
-static void sjsonbuf_init(sjsonbuf *buf) {
-    buf->cap = 128;
-    buf->len = 0;
-    buf->buf = (char *)malloc(buf->cap);
-}
+/**
+ * @brief value of number v, integers rounded to double
+ */
+double sjson_tape_num(const sjson_tape *tape, size_t v);
 
-static void sjsonbuf_push(sjsonbuf *buf, const void *s, size_t len) {
-    while (buf->cap - buf->len <= len + 1)
-        buf->cap *= 2;
-    buf->buf = (char *)realloc(buf->buf, buf->cap);
-    memcpy(buf->buf + buf->len, s, len);
-    buf->len += len;
-    buf->buf[buf->len] = '\x0';
-}
+/**
+ * @brief value of number v, doubles truncated to int64_t
+ */
+int64_t sjson_tape_int(const sjson_tape *tape, size_t v);
 
-static char sjsonlexer_advance(sjsonlexer *lexer) {
-    if (lexer->c <= lexer->end)
-        return (lexer->c++)[0];
-    return -1;
-}
+/**
+ * @brief number of children of container v
+ */
+size_t sjson_tape_count(const sjson_tape *tape, size_t v);
 
-static char sjsonlexer_peek(sjsonlexer *lexer) { return (lexer->c)[0]; }
+/**
+ * @brief first child value of container v, 0 if it has none
+ */
+size_t sjson_tape_first(const sjson_tape *tape, size_t v);
 
-static bool sjsonlexer_isend(sjsonlexer *lexer) {
-    return lexer->c >= lexer->end;
-}
+/**
+ * @brief child value after child value v, 0 if v is the last
+ */
+size_t sjson_tape_next(const sjson_tape *tape, size_t v);
 
-static void sjsonlexer_init(sjsonlexer *lexer, const char *s, size_t len) {
-    lexer->start = s, lexer->end = s + len, lexer->c = s,
-    lexer->toks = sjsontokarr_new();
-}
-
-static SjsonResult sjsonlexer_lexnumber(sjsonlexer *lexer) {
-    const char *numberstart = lexer->c;
-    bool didpoint = false, didsign = false;
-    sjsonbuf buf;
-    sjsonbuf_init(&buf);
-
-    while (!sjsonlexer_isend(lexer)) {
-        char c = sjsonlexer_peek(lexer);
-        if (!isdigit(c)) {
-            if (c == '+' || c == '-') {
-                if (didsign)
-                    return SJSON_ERR_INVALID_SOURCE;
-                didsign = true;
-            } else if (c == '.') {
-                if (didpoint)
-                    return SJSON_ERR_INVALID_SOURCE;
-                didpoint = true;
-            } else {
-                break;
-            }
-        }
-        sjsonlexer_advance(lexer);
-    }
-    lexer->c--;
+/**
+ * @brief key of child value v of an object
+ * @param len set to length of the key if not NULL
+ */
+const char *sjson_tape_key(const sjson_tape *tape, size_t v, size_t *len);
 
-    /* avoid modification of original source */
-    sjsonbuf_push(&buf, numberstart, lexer->c - numberstart + 1);
+/**
+ * @brief get first child value of object with matching key
+ * @param tape tape
+ * @param v object
+ * @param key key to get
+ * @param child set to the child value
+ */
+SjsonResult sjson_tape_object_get(const sjson_tape *tape, size_t v,
+                                  const char *key, size_t *child);
 
-    sjsonlexer_pushtok(lexer, SJSON_TKNUMBERLITERAL, buf.buf, lexer->c);
+/**
+ * @brief get child value of array by index
+ * @param tape tape
+ * @param v array
+ * @param i index of child
+ * @param child set to the child value
+ */
+SjsonResult sjson_tape_array_get(const sjson_tape *tape, size_t v, size_t i,
+                                 size_t *child);
 
-    return SJSON_SUCCESS;
-}
+/**
+ * @brief deserialize s into compact nodes allocated in arena
+ * @param arena arena that will own every node and string
+ * @param s json source
+ * @param len length of parameter s
+ * @param flags SJSON_OPT_ZEROCOPY and / or SJSON_OPT_VALIDATE_UTF8,
+ * zero-copy strings are not NUL-terminated, otherwise they are
+ * @param root set to the root node
+ */
+SjsonResult sjson_compact_deserialize(sjson_arena *arena, const char *s,
+                                      size_t len, int flags,
+                                      sjson_compact **root);
 
-static SjsonResult sjsonlexer_lexstring(sjsonlexer *lexer) {
-    if (sjsonlexer_advance(lexer) != '\"')
-        return SJSON_ERR_WRONG_TYPE;
+/**
+ * @brief get first child of compact object with matching key
+ * @param json object
+ * @param key key to get
+ * @param child set to the child
+ */
+SjsonResult sjson_compact_object_get(const sjson_compact *json,
+                                     const char *key, sjson_compact **child);
 
-    const char *stringend = lexer->c;
+/**
+ * @brief get child of compact array by index, in constant time
+ * @param json array
+ * @param i index of child
+ * @param child set to the child
+ */
+SjsonResult sjson_compact_array_get(const sjson_compact *json, size_t i,
+                                    sjson_compact **child);
 
-    /* find terminating double quote, need to escape \" */
-    while (stringend[0] != '\"') {
-        if (stringend > lexer->end)
-            return SJSON_ERR_NO_TERMINATING_DOUBLE_QUOTE;
-        if (stringend[0] == '\\')
-            stringend++;
-        stringend++;
-    }
-
-    /* can't just push new token, escape character reasons */
-    sjsonbuf buf;
-    sjsonbuf_init(&buf);
-    while (lexer->c < stringend) {
-        char ch = sjsonlexer_advance(lexer);
-        if (ch == '\\') {
-            int advance_ret;
-            if ((advance_ret = sjsonlexer_advance(lexer)) == -1)
-                return SJSON_ERR_NO_TERMINATING_DOUBLE_QUOTE;
-            /* deal with escape character */
-            switch (advance_ret) {
-            case '\\':
-                sjsonbuf_push(&buf, "\\", 1);
-                break;
-            case 'n':
-                sjsonbuf_push(&buf, "\n", 1);
-                break;
-            case 'f':
-                sjsonbuf_push(&buf, "\f", 1);
-                break;
-            case 'r':
-                sjsonbuf_push(&buf, "\r", 1);
-                break;
-            case 't':
-                sjsonbuf_push(&buf, "\t", 1);
-                break;
-            case '\"':
-                sjsonbuf_push(&buf, "\"", 1);
-                break;
-            case '/':
-                sjsonbuf_push(&buf, "/", 1);
-                break;
-                /*
-            case 'u': {
-                break;
-            }
-            */
-            default:
+/**
+ * @brief canonical copy of key in table, the same pointer for equal keys
+ * @param table intern table
+ * @param key key, need not be terminated
+ * @param len length of key
+ * @return NUL-terminated key owned by table, NULL if out of memory
+ */
+const char *sjson_intern_key(sjson_intern *table, const char *key,
+                             size_t len);
+
+/**
+ * @brief free table and every key in it
+ */
+void sjson_intern_free(sjson_intern *table);
+
+/**
+ * @brief build structural index of s, 16 or 32 bytes at a time
+ * with SSE2 / AVX2, or a scalar loop otherwise
+ * @param s json source
+ * @param len length of parameter s
+ * @param idx index to fill, zero-initialized or from a previous call
+ */
+SjsonResult sjson_structural_index(const char *s, size_t len,
+                                   sjson_structural *idx);
+
+/**
+ * @brief free offsets held by idx
+ */
+void sjson_structural_free(sjson_structural *idx);
+
+/**
+ * @brief allocate size bytes from arena
+ * @return pointer aligned for any sjson field, NULL if out of memory
+ */
+void *sjson_arena_alloc(sjson_arena *arena, size_t size);
+
+/**
+ * @brief free every block of arena, invalidating all nodes in it
+ */
+void sjson_arena_free(sjson_arena *arena);
+
+/**
+ * @brief empty arena but keep its memory, invalidating all nodes in it,
+ * several blocks are replaced by one as large as all of them, so
+ * allocating as much again needs no malloc
+ */
+void sjson_arena_reset(sjson_arena *arena);
+
+/**
+ * @brief serialize sjson * to C-string in sjsonbuf
+ * @return buffer holding length, capacity, and pointer to C-string
+ */
+sjsonbuf sjson_serialize(sjson *json);
+
+/**
+ * @brief serialize json by appending to buf, no intermediate buffers
+ * @param json value to serialize
+ * @param buf buffer to append to, zero-initialized or from earlier call
+ */
+SjsonResult sjson_serialize_into(sjson *json, sjsonbuf *buf);
+
+/**
+ * @brief serialize json through write in chunks of SJSON_WRITE_CHUNK,
+ * memory use does not depend on document size
+ * @param json value to serialize
+ * @param write output callback, e.g. sjson_write_file or sjson_write_fd
+ * @param ctx first argument of write
+ * @return SJSON_ERR_WRITE if write failed
+ */
+SjsonResult sjson_serialize_to(sjson *json, sjson_writefn write, void *ctx);
+
+/**
+ * @brief serialize json, copying subtrees unchanged since the last call
+ * from that call's output instead of encoding them again
+ * @param json root of a document, a node with a parent is serialized
+ * in full, without the cache
+ * @param buf output of the previous call for json, or empty, replaced
+ * by the new output on success, free(buf->buf) when done
+ *
+ * containers remember where their bytes were, sjson_addchild,
+ * sjson_deletechild, sjson_replace and the functions built on them mark
+ * the path from the change to the root, call sjson_touch after
+ * assigning to a node's fields directly
+ */
+SjsonResult sjson_serialize_cached(sjson *json, sjsonbuf *buf);
+
+/**
+ * @brief mark json and its ancestors as changed for
+ * sjson_serialize_cached, needed after editing fields such as v.num
+ * or v.str by hand
+ */
+void sjson_touch(sjson *json);
+
+/**
+ * @brief append escaped form of string, without quotes, to out
+ * @param s string, UTF-8
+ * @param len length of parameter s
+ * @param flags SJSON_ESCAPE_ASCII to escape every non-ASCII character
+ * as \uXXXX, invalid UTF-8 then becomes \ufffd
+ * @param out buffer to append to, zero-initialized or from earlier call
+ */
+SjsonResult sjson_escape(const char *s, size_t len, int flags, sjsonbuf *out);
+
+/**
+ * @brief append decoded form of escaped string body, without quotes,
+ * to out, \uXXXX and surrogate pairs become UTF-8
+ * @param s escaped string
+ * @param len length of parameter s
+ * @param out buffer to append to, zero-initialized or from earlier call
+ * @return SJSON_ERR_INVALID_ESCAPE_SEQUENCE on unknown or short escape
+ */
+SjsonResult sjson_unescape(const char *s, size_t len, sjsonbuf *out);
+
+/**
+ * @brief check that s is valid UTF-8: no overlong forms, surrogates,
+ * code points above U+10FFFF or truncated sequences
+ * @param s bytes to check
+ * @param len length of parameter s
+ * @return true if valid
+ */
+bool sjson_utf8_valid(const char *s, size_t len);
+
+/**
+ * @brief open object, end it with sjson_writer_end_object
+ */
+SjsonResult sjson_writer_begin_object(sjson_writer *w);
+SjsonResult sjson_writer_end_object(sjson_writer *w);
+
+/**
+ * @brief open array, end it with sjson_writer_end_array
+ */
+SjsonResult sjson_writer_begin_array(sjson_writer *w);
+SjsonResult sjson_writer_end_array(sjson_writer *w);
+
+/**
+ * @brief write key of next object member, its value must follow
+ * @param w writer
+ * @param key key, UTF-8, escaped as needed
+ * @param len length of parameter key
+ */
+SjsonResult sjson_writer_key(sjson_writer *w, const char *key, size_t len);
+
+/**
+ * @brief write string value
+ * @param w writer
+ * @param s string, UTF-8, escaped as needed
+ * @param len length of parameter s
+ */
+SjsonResult sjson_writer_string(sjson_writer *w, const char *s, size_t len);
+
+/**
+ * @brief write number value, shortest form that reads back the same,
+ * NaN and infinities as null
+ */
+SjsonResult sjson_writer_number(sjson_writer *w, double num);
+
+/**
+ * @brief write integer value, exact
+ */
+SjsonResult sjson_writer_int(sjson_writer *w, int64_t i);
+
+/**
+ * @brief write true or false
+ */
+SjsonResult sjson_writer_bool(sjson_writer *w, bool b);
+
+/**
+ * @brief write null
+ */
+SjsonResult sjson_writer_null(sjson_writer *w);
+
+/**
+ * @brief write tree json as one value
+ */
+SjsonResult sjson_writer_json(sjson_writer *w, sjson *json);
+
+/**
+ * @brief empty w for the next document, keeping its buffers
+ */
+void sjson_writer_reset(sjson_writer *w);
+
+/**
+ * @brief free buffer of w
+ */
+void sjson_writer_free(sjson_writer *w);
+
+/**
+ * @brief encode json as MessagePack by appending to buf
+ * @param json value to encode, lazy containers are expanded
+ * @param buf buffer to append to, zero-initialized or from earlier call
+ *
+ * integers, and numbers with an integral value, use the smallest int
+ * format, other numbers float 32 if exact, else float 64. strings and
+ * keys of 4 GiB or more fail with SJSON_ERR_WRONG_TYPE
+ */
+SjsonResult sjson_msgpack_encode(sjson *json, sjsonbuf *buf);
+
+/**
+ * @brief decode one MessagePack value to sjson *
+ * @param s MessagePack bytes
+ * @param len length of parameter s, which must hold exactly one value
+ * @param opt options, NULL for defaults, SJSON_OPT_LAZY has no effect
+ *
+ * nil, bool, int, float, str, array and map decode to the sjson_type
+ * they were encoded from, uint 64 above INT64_MAX to a plain number.
+ * bin and ext fail with SJSON_ERR_UNKNOWN_TOKEN, map keys other than
+ * str with SJSON_ERR_WRONG_TYPE, truncated input with
+ * SJSON_ERR_INVALID_SOURCE
+ */
+sjson_result sjson_msgpack_decode(const char *s, size_t len,
+                                  const sjson_options *opt);
+
+/**
+ * @brief sjson_writefn writing to FILE * passed as ctx
+ */
+int sjson_write_file(void *fp, const char *data, size_t len);
+
+#ifdef SJSON_HAVE_FD
+/**
+ * @brief sjson_writefn writing to file descriptor, ctx points to an int
+ */
+int sjson_write_fd(void *fd, const char *data, size_t len);
+#endif /* SJSON_HAVE_FD */
+
+/**
+ * @brief hand next chunk of input to pull parser
+ * @param pull parser
+ * @param s chunk, must stay valid until sjson_pull_next needs more input
+ * @param len length of parameter s
+ * @param last true if no input follows this chunk
+ */
+void sjson_pull_feed(sjson_pull *pull, const char *s, size_t len, bool last);
+
+/**
+ * @brief pull next event of document
+ * @param pull parser
+ * @param ev event to fill
+ * @return SJSON_SUCCESS with ev filled, SJSON_ERR_NEED_INPUT once the
+ * chunk is consumed and sjson_pull_feed must be called, else parse error
+ */
+SjsonResult sjson_pull_next(sjson_pull *pull, sjson_event *ev);
+
+/**
+ * @brief free buffers held by pull, it may be reused afterwards
+ */
+void sjson_pull_free(sjson_pull *pull);
+
+static void sjsonlexer_init(sjsonlexer *lexer, const char *s, size_t len);
+static SjsonResult sjsonlexer_next(sjsonlexer *lexer, sjsontok *tok);
+static sjson_result sjson_parse(sjsonparser *parser);
+
+/**
+ * @brief build children of a container deserialized with SJSON_OPT_LAZY,
+ * containers among them stay lazy, no-op for any other node
+ * @param json node
+ * @return error found in its source, the node then stays lazy
+ *
+ * lookups and edits expand on their own, call this before walking
+ * children with sjson_foreach
+ */
+SjsonResult sjson_expand(sjson *json);
+
+/**
+ * @brief get child by index
+ */
+sjson_result sjson_array_get(sjson *json, size_t i);
+/**
+ * @brief replace index-th child of array to json
+ * @param json array
+ * @param i index of child to replace
+ * @param x new child value
+ */
+SjsonResult sjson_array_set(sjson *json, size_t i, sjson *x);
+/**
+ * @brief remove i-th child of array
+ * @param json array
+ * @param i index of child element to remove
+ */
+SjsonResult sjson_array_delete(sjson *json, size_t i);
+/**
+ * @brief get first child of object with matching key
+ * @param json object
+ * @param key key to get
+ */
+
+sjson_result sjson_object_get(sjson *json, char *key);
+/**
+ * @brief set key property of object to json
+ * @param json object
+ * @param key key of new child
+ * @param value new child to add
+ *
+ * This function call sjson_object_delete_all(json, key)
+ * before adding child. Causing every prior child having the same key
+ * to be deleted
+ */
+SjsonResult sjson_object_set(sjson *json, char *key, sjson *value);
+/**
+ * @brief delete all child with matching key
+ * @param json parent node
+ * @param key key to delete
+ */
+SjsonResult sjson_object_delete_all(sjson *json, char *key);
+// SjsonResult sjson_array_del(sjson *json, char *key, sjson *value);
+
+/**
+ * @brief add child to json's children
+ * @param json parent node
+ * @param child child node
+ */
+SjsonResult sjson_addchild(sjson *json, sjson *child);
+
+/**
+ * @brief delete child from json's children
+ * @param json parent node
+ * @param child child node
+ * @return SJSON_SUCCESS (0) if success, else non-zero
+ */
+SjsonResult sjson_deletechild(sjson *json, sjson *child);
+
+/**
+ * @brief add element to end of array
+ * @param json parent node
+ * @param child child node
+ * @return SJSON_SUCCESS (0) if success, else non-zero
+ */
+#define sjson_array_push sjson_addchild
+
+#endif /* SHEEP_SJSON_H */
+
+#ifdef SHEEP_SJSON_IMPLEMENTATION
+
+#include <stdint.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef SJSON_HAVE_FD
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif /* SJSON_HAVE_FD */
+
+#ifdef SJSON_HAVE_THREADS
+#include <pthread.h>
+#endif /* SJSON_HAVE_THREADS */
+
+/* SIMD: define SJSON_NO_SIMD to force the scalar code paths */
+#if !defined(SJSON_NO_SIMD) && defined(__AVX2__)
+#include <immintrin.h>
+#define SJSON_VW 32
+typedef __m256i sjsonvec;
+#define sjsonvec_load(p) _mm256_loadu_si256((const __m256i *)(p))
+#define sjsonvec_eq(v, ch) _mm256_cmpeq_epi8((v), _mm256_set1_epi8(ch))
+#define sjsonvec_or(a, b) _mm256_or_si256((a), (b))
+#define sjsonvec_mask(v) ((uint32_t)_mm256_movemask_epi8(v))
+/* bytes <= ch, unsigned */
+#define sjsonvec_le(v, ch)                                                     \
+    _mm256_cmpeq_epi8(_mm256_max_epu8((v), _mm256_set1_epi8(ch)),               \
+                      _mm256_set1_epi8(ch))
+#elif !defined(SJSON_NO_SIMD) &&                                               \
+    (defined(__SSE2__) || defined(_M_X64) ||                                   \
+     (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define SJSON_VW 16
+typedef __m128i sjsonvec;
+#define sjsonvec_load(p) _mm_loadu_si128((const __m128i *)(p))
+#define sjsonvec_eq(v, ch) _mm_cmpeq_epi8((v), _mm_set1_epi8(ch))
+#define sjsonvec_or(a, b) _mm_or_si128((a), (b))
+#define sjsonvec_mask(v) ((uint32_t)_mm_movemask_epi8(v))
+#define sjsonvec_le(v, ch)                                                     \
+    _mm_cmpeq_epi8(_mm_max_epu8((v), _mm_set1_epi8(ch)), _mm_set1_epi8(ch))
+#endif
+
+static int sjson_ctz(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(x);
+#else
+    int n = 0;
+    while (!(x & 1))
+        x >>= 1, n++;
+    return n;
+#endif
+}
+
+static bool sjson_isspace(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+#ifndef SJSON_VW
+static bool sjson_isop(char c) {
+    return c == '{' || c == '}' || c == '[' || c == ']' || c == ':' ||
+           c == ',';
+}
+#endif
+
+/* first byte of [p, end) that is not json whitespace */
+static const char *sjson_skipspace(const char *p, const char *end) {
+    /* values are usually packed, don't pay for a vector load */
+    if (p < end && !sjson_isspace(*p))
+        return p;
+#ifdef SJSON_VW
+    for (; end - p >= SJSON_VW; p += SJSON_VW) {
+        sjsonvec v = sjsonvec_load(p);
+        uint32_t m = sjsonvec_mask(
+            sjsonvec_or(sjsonvec_or(sjsonvec_eq(v, ' '), sjsonvec_eq(v, '\n')),
+                        sjsonvec_or(sjsonvec_eq(v, '\t'), sjsonvec_eq(v, '\r'))));
+        if (m != (uint32_t)((1ull << SJSON_VW) - 1))
+            return p + sjson_ctz(~m);
+    }
+#endif
+    while (p < end && sjson_isspace(*p))
+        p++;
+    return p;
+}
+
+/* first double quote or backslash in [p, end), end if none */
+static const char *sjson_scanstring(const char *p, const char *end) {
+#ifdef SJSON_VW
+    for (; end - p >= SJSON_VW; p += SJSON_VW) {
+        sjsonvec v = sjsonvec_load(p);
+        uint32_t m =
+            sjsonvec_mask(sjsonvec_or(sjsonvec_eq(v, '"'), sjsonvec_eq(v, '\\')));
+        if (m)
+            return p + sjson_ctz(m);
+    }
+#endif
+    while (p < end && *p != '"' && *p != '\\')
+        p++;
+    return p;
+}
+
+/* first newline or double quote of [p, end) */
+static const char *sjson_scanline(const char *p, const char *end) {
+#ifdef SJSON_VW
+    for (; end - p >= SJSON_VW; p += SJSON_VW) {
+        sjsonvec v = sjsonvec_load(p);
+        uint32_t m =
+            sjsonvec_mask(sjsonvec_or(sjsonvec_eq(v, '"'), sjsonvec_eq(v, '\n')));
+        if (m)
+            return p + sjson_ctz(m);
+    }
+#endif
+    while (p < end && *p != '"' && *p != '\n')
+        p++;
+    return p;
+}
+
+/* code point of UTF-8 sequence at p into *cp, its length, 1 and U+FFFD
+ * if it is not a valid sequence */
+static size_t sjson_utf8_decode(const unsigned char *p,
+                                const unsigned char *end, uint32_t *cp) {
+    size_t n;
+    uint32_t min;
+    if (p[0] < 0x80) {
+        *cp = p[0];
+        return 1;
+    }
+    if (p[0] >= 0xc2 && p[0] < 0xe0)
+        n = 2, min = 0x80, *cp = p[0] & 0x1f;
+    else if (p[0] >= 0xe0 && p[0] < 0xf0)
+        n = 3, min = 0x800, *cp = p[0] & 0x0f;
+    else if (p[0] >= 0xf0 && p[0] < 0xf5)
+        n = 4, min = 0x10000, *cp = p[0] & 0x07;
+    else
+        goto invalid;
+    if ((size_t)(end - p) < n)
+        goto invalid;
+    for (size_t i = 1; i < n; i++) {
+        if ((p[i] & 0xc0) != 0x80)
+            goto invalid;
+        *cp = *cp << 6 | (p[i] & 0x3f);
+    }
+    /* overlong, surrogate, beyond unicode */
+    if (*cp < min || (*cp >= 0xd800 && *cp < 0xe000) || *cp > 0x10ffff)
+        goto invalid;
+    return n;
+invalid:
+    *cp = 0xfffd;
+    return 1;
+}
+
+/* like sjson_scanstring, also sets *nonascii if a byte >= 0x80 may
+ * come before the result, vectors are checked as a whole */
+static const char *sjson_scanstringutf8(const char *p, const char *end,
+                                        bool *nonascii) {
+#ifdef SJSON_VW
+    for (; end - p >= SJSON_VW; p += SJSON_VW) {
+        sjsonvec v = sjsonvec_load(p);
+        uint32_t m =
+            sjsonvec_mask(sjsonvec_or(sjsonvec_eq(v, '"'), sjsonvec_eq(v, '\\')));
+        *nonascii |= sjsonvec_mask(v) != 0;
+        if (m)
+            return p + sjson_ctz(m);
+    }
+#endif
+    for (; p < end && *p != '"' && *p != '\\'; p++)
+        *nonascii |= (unsigned char)*p >= 0x80;
+    return p;
+}
+
+bool sjson_utf8_valid(const char *s, size_t len) {
+    const unsigned char *p = (const unsigned char *)s, *end = p + len;
+    uint32_t cp;
+    while (p < end) {
+#ifdef SJSON_VW
+        /* ASCII a vector at a time, stop at first byte >= 0x80 */
+        if (end - p >= SJSON_VW) {
+            uint32_t m = sjsonvec_mask(sjsonvec_load(p));
+            if (m == 0) {
+                p += SJSON_VW;
+                continue;
+            }
+            p += sjson_ctz(m);
+        }
+#endif
+        if (*p < 0x80) {
+            p++;
+            continue;
+        }
+        size_t n = sjson_utf8_decode(p, end, &cp);
+        if (n == 1)
+            return false;
+        p += n;
+    }
+    return true;
+}
+
+/* bitmasks of one 64 byte block, bit i is byte i */
+typedef struct sjsonblock {
+    uint64_t quote, backslash, op, space;
+    uint64_t open, close; /* brackets, also part of op */
+} sjsonblock;
+
+static void sjson_classify(const char *p, sjsonblock *b) {
+    b->quote = b->backslash = b->op = b->space = b->open = b->close = 0;
+#ifdef SJSON_VW
+    for (int i = 0; i < 64; i += SJSON_VW) {
+        sjsonvec v = sjsonvec_load(p + i);
+        sjsonvec open = sjsonvec_or(sjsonvec_eq(v, '{'), sjsonvec_eq(v, '['));
+        sjsonvec close = sjsonvec_or(sjsonvec_eq(v, '}'), sjsonvec_eq(v, ']'));
+        sjsonvec op =
+            sjsonvec_or(sjsonvec_or(open, close),
+                        sjsonvec_or(sjsonvec_eq(v, ':'), sjsonvec_eq(v, ',')));
+        sjsonvec sp = sjsonvec_or(
+            sjsonvec_or(sjsonvec_eq(v, ' '), sjsonvec_eq(v, '\n')),
+            sjsonvec_or(sjsonvec_eq(v, '\t'), sjsonvec_eq(v, '\r')));
+        b->quote |= (uint64_t)sjsonvec_mask(sjsonvec_eq(v, '"')) << i;
+        b->backslash |= (uint64_t)sjsonvec_mask(sjsonvec_eq(v, '\\')) << i;
+        b->op |= (uint64_t)sjsonvec_mask(op) << i;
+        b->space |= (uint64_t)sjsonvec_mask(sp) << i;
+        b->open |= (uint64_t)sjsonvec_mask(open) << i;
+        b->close |= (uint64_t)sjsonvec_mask(close) << i;
+    }
+#else
+    for (int i = 0; i < 64; i++) {
+        uint64_t bit = 1ull << i;
+        if (p[i] == '"')
+            b->quote |= bit;
+        else if (p[i] == '\\')
+            b->backslash |= bit;
+        else if (sjson_isop(p[i]))
+            b->op |= bit;
+        else if (sjson_isspace(p[i]))
+            b->space |= bit;
+        if (p[i] == '{' || p[i] == '[')
+            b->open |= bit;
+        else if (p[i] == '}' || p[i] == ']')
+            b->close |= bit;
+    }
+#endif
+}
+
+/* bytes of a block escaped by a backslash, backslashes are rare so walk
+ * them, an escaped one escapes nothing, *carry escapes next block's first */
+static uint64_t sjson_escapes(uint64_t bs, uint64_t *carry) {
+    uint64_t escaped = *carry;
+    *carry = 0;
+    while (bs) {
+        int i = sjson_ctz(bs);
+        if (!(escaped >> i & 1)) {
+            if (i == 63)
+                *carry = 1;
+            else
+                escaped |= 1ull << (i + 1);
+        }
+        bs &= bs - 1;
+    }
+    return escaped;
+}
+
+static int sjson_popcount(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcountll(x);
+#else
+    int n = 0;
+    for (; x; x &= x - 1)
+        n++;
+    return n;
+#endif
+}
+
+/* bit i set if byte i is 1 in an odd number of bits of x at or below i */
+static uint64_t sjson_prefixxor(uint64_t x) {
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+SjsonResult sjson_structural_index(const char *s, size_t len,
+                                   sjson_structural *idx) {
+    /* carries from the previous block */
+    uint64_t escapednext = 0, instring = 0, prevscalar = 0;
+    char tail[64];
+
+    if (len > UINT32_MAX)
+        return SJSON_ERR_INVALID_SOURCE;
+    idx->len = 0;
+    for (size_t off = 0; off < len; off += 64) {
+        const char *p = s + off;
+        sjsonblock b;
+
+        /* pad the last block with whitespace */
+        if (len - off < 64) {
+            memset(tail, ' ', sizeof tail);
+            memcpy(tail, p, len - off);
+            p = tail;
+        }
+        sjson_classify(p, &b);
+
+        uint64_t escaped = sjson_escapes(b.backslash, &escapednext);
+        uint64_t quote = b.quote & ~escaped;
+        /* opening quote up to, not including, closing quote */
+        uint64_t inside = sjson_prefixxor(quote) ^ instring;
+        instring = (uint64_t)0 - (inside >> 63);
+        uint64_t stringtail = inside ^ quote;
+
+        /* first byte of number, true, false, null */
+        uint64_t scalar = ~(b.op | b.space | quote);
+        uint64_t scalarstart = scalar & ~(scalar << 1 | prevscalar);
+        prevscalar = scalar >> 63;
+
+        uint64_t structural = (b.op | quote | scalarstart) & ~stringtail;
+        if (idx->cap - idx->len < 64) {
+            size_t cap = idx->cap ? idx->cap * 2 : 256;
+            uint32_t *pos = (uint32_t *)realloc(idx->pos, cap * sizeof(*pos));
+            if (pos == NULL)
+                return SJSON_ERR_NO_MEMORY;
+            idx->pos = pos;
+            idx->cap = cap;
+        }
+        while (structural) {
+            size_t i = off + sjson_ctz(structural);
+            if (i >= len)
+                break;
+            idx->pos[idx->len++] = (uint32_t)i;
+            structural &= structural - 1;
+        }
+    }
+    if (instring)
+        return SJSON_ERR_NO_TERMINATING_DOUBLE_QUOTE;
+    return SJSON_SUCCESS;
+}
+
+/* past closing quote of string whose body starts at p, NULL if none */
+static const char *sjson_skipstring(const char *p, const char *end) {
+    while ((p = sjson_scanstring(p, end)) < end && *p == '\\')
+        p += 2;
+    return p < end ? p + 1 : NULL;
+}
+
+/**
+ * end of the value starting at p, NULL if it does not end in [p, end)
+ *
+ * containers are matched by bracket depth alone and scalars end at the
+ * next delimiter, nothing is validated, that is left to whoever parses
+ * the span
+ */
+static const char *sjson_skipvalue(const char *p, const char *end) {
+    size_t depth = 0;
+    if (p >= end)
+        return NULL;
+    if (*p == '"')
+        return sjson_skipstring(p + 1, end);
+    if (*p != '{' && *p != '[') {
+        while (p < end && !sjson_isspace(*p) && *p != ',' && *p != ':' &&
+               *p != '}' && *p != ']')
+            p++;
+        return p;
+    }
+    /* 64 bytes at a time, like sjson_structural_index */
+    uint64_t escapednext = 0, instring = 0;
+    char tail[64];
+    for (const char *block = p; block < end; block += 64) {
+        const char *q = block;
+        sjsonblock b;
+        if (end - block < 64) {
+            memset(tail, ' ', sizeof tail);
+            memcpy(tail, block, end - block);
+            q = tail;
+        }
+        sjson_classify(q, &b);
+        uint64_t quote = b.quote & ~sjson_escapes(b.backslash, &escapednext);
+        uint64_t inside = sjson_prefixxor(quote) ^ instring;
+        instring = (uint64_t)0 - (inside >> 63);
+        uint64_t open = b.open & ~inside, close = b.close & ~inside;
+
+        /* depth can't reach zero in this block, count brackets at once */
+        if (depth > (size_t)sjson_popcount(close)) {
+            depth += sjson_popcount(open) - sjson_popcount(close);
+            continue;
+        }
+        for (uint64_t m = open | close; m; m &= m - 1) {
+            int i = sjson_ctz(m);
+            if (open >> i & 1)
+                depth++;
+            else if (--depth == 0)
+                return block + i + 1;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * first top-level comma at or after each of n - 1 evenly spaced offsets
+ * of the array starting at p into cuts, returns how many were found,
+ * fewer if the array ends first. scanned like sjson_skipvalue, blocks
+ * before the next offset only have their brackets counted
+ */
+static int sjson_arraycuts(const char *p, const char *end, int n,
+                           const char **cuts) {
+    size_t depth = 0;
+    int k = 1;
+    const char *target = p + (end - p) / n;
+    uint64_t escapednext = 0, instring = 0;
+    char tail[64];
+    for (const char *block = p; block < end && k < n; block += 64) {
+        const char *q = block;
+        sjsonblock b;
+        if (end - block < 64) {
+            memset(tail, ' ', sizeof tail);
+            memcpy(tail, block, end - block);
+            q = tail;
+        }
+        sjson_classify(q, &b);
+        uint64_t quote = b.quote & ~sjson_escapes(b.backslash, &escapednext);
+        uint64_t inside = sjson_prefixxor(quote) ^ instring;
+        instring = (uint64_t)0 - (inside >> 63);
+        uint64_t open = b.open & ~inside, close = b.close & ~inside;
+        bool want = block + 64 > target;
+
+        if (!want && depth > (size_t)sjson_popcount(close)) {
+            depth += sjson_popcount(open) - sjson_popcount(close);
+            continue;
+        }
+        uint64_t m = open | close;
+        if (want)
+            m |= b.op & ~inside;
+        for (; m; m &= m - 1) {
+            int i = sjson_ctz(m);
+            if (open >> i & 1) {
+                depth++;
+            } else if (close >> i & 1) {
+                if (--depth == 0)
+                    return k - 1;
+            } else if (q[i] == ',' && depth == 1 && block + i >= target) {
+                cuts[k - 1] = block + i;
+                if (++k == n)
+                    break;
+                target = p + (end - p) / n * k;
+            }
+        }
+    }
+    return k - 1;
+}
+
+void sjson_structural_free(sjson_structural *idx) {
+    free(idx->pos);
+    idx->pos = NULL;
+    idx->len = idx->cap = 0;
+}
+
+static void sjsonbuf_init(sjsonbuf *buf) {
+    buf->cap = 128;
+    buf->len = 0;
+    buf->buf = (char *)malloc(buf->cap);
+}
+
+/* room for len more bytes and a NUL, buf may be zero-initialized */
+static SjsonResult sjsonbuf_reserve(sjsonbuf *buf, size_t len) {
+    if (buf->cap - buf->len <= len + 1) {
+        size_t cap = buf->cap ? buf->cap : 128;
+        while (cap - buf->len <= len + 1)
+            cap *= 2;
+        char *p = (char *)realloc(buf->buf, cap);
+        if (p == NULL)
+            return SJSON_ERR_NO_MEMORY;
+        buf->buf = p;
+        buf->cap = cap;
+    }
+    return SJSON_SUCCESS;
+}
+
+/* append, buf may be zero-initialized */
+static SjsonResult sjsonbuf_push(sjsonbuf *buf, const void *s, size_t len) {
+    if (sjsonbuf_reserve(buf, len))
+        return SJSON_ERR_NO_MEMORY;
+    memcpy(buf->buf + buf->len, s, len);
+    buf->len += len;
+    buf->buf[buf->len] = '\x0';
+    return SJSON_SUCCESS;
+}
+
+#ifndef SJSON_ARENA_BLOCK
+#define SJSON_ARENA_BLOCK 4096
+#endif /* SJSON_ARENA_BLOCK */
+
+#define SJSON_ARENA_ALIGN 16
+
+struct sjsonarenablock {
+    struct sjsonarenablock *prev;
+    size_t len, cap;
+};
+
+static size_t sjson_arena_round(size_t n) {
+    return (n + SJSON_ARENA_ALIGN - 1) & ~(size_t)(SJSON_ARENA_ALIGN - 1);
+}
+
+void *sjson_arena_alloc(sjson_arena *arena, size_t size) {
+    const size_t hdr = sjson_arena_round(sizeof(struct sjsonarenablock));
+    struct sjsonarenablock *b = arena->head;
+    size = sjson_arena_round(size);
+    if (b == NULL || b->cap - b->len < size) {
+        size_t cap = b ? b->cap * 2 : SJSON_ARENA_BLOCK;
+        while (cap < size)
+            cap *= 2;
+        struct sjsonarenablock *nb =
+            (struct sjsonarenablock *)malloc(hdr + cap);
+        if (nb == NULL)
+            return NULL;
+        nb->prev = b;
+        nb->len = 0;
+        nb->cap = cap;
+        arena->head = b = nb;
+    }
+    void *p = (char *)b + hdr + b->len;
+    b->len += size;
+    return p;
+}
+
+void sjson_arena_free(sjson_arena *arena) {
+    struct sjsonarenablock *b = arena->head;
+    while (b != NULL) {
+        struct sjsonarenablock *prev = b->prev;
+        free(b);
+        b = prev;
+    }
+    arena->head = NULL;
+}
+
+void sjson_arena_reset(sjson_arena *arena) {
+    const size_t hdr = sjson_arena_round(sizeof(struct sjsonarenablock));
+    struct sjsonarenablock *b = arena->head;
+    size_t cap = 0;
+    if (b == NULL)
+        return;
+    if (b->prev != NULL) {
+        for (; b != NULL; b = b->prev)
+            cap += b->cap;
+        sjson_arena_free(arena);
+        /* without memory for one block, start from scratch next time */
+        b = (struct sjsonarenablock *)malloc(hdr + cap);
+        if (b == NULL)
+            return;
+        b->prev = NULL;
+        b->cap = cap;
+        arena->head = b;
+    }
+    b->len = 0;
+}
+
+static void sjsonlexer_init(sjsonlexer *lexer, const char *s, size_t len) {
+    lexer->start = s, lexer->end = s + len, lexer->c = s;
+    lexer->arena = NULL;
+    lexer->flags = 0;
+    lexer->intern = NULL;
+    lexer->maxdepth = SJSON_MAX_DEPTH;
+    lexer->home = NULL;
+}
+
+/* storage for decoded literals, from arena if the lexer has one */
+static void *sjsonlexer_alloc(sjsonlexer *lexer, size_t size) {
+    if (lexer->arena)
+        return sjson_arena_alloc(lexer->arena, size);
+    return malloc(size);
+}
+
+/* exact powers of ten, every double up to 1e22 is representable */
+static const double sjson_pow10[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+/* strtod wants a terminated string, source may not be */
+static double sjson_strtod(const char *start, const char *end) {
+    char buf[512], *copy = buf;
+    size_t len = end - start;
+    double num;
+    if (len >= sizeof buf && (copy = (char *)malloc(len + 1)) == NULL)
+        return 0;
+    memcpy(copy, start, len);
+    copy[len] = '\x0';
+    num = strtod(copy, NULL);
+    if (copy != buf)
+        free(copy);
+    return num;
+}
+
+/**
+ * lex number at [p, end) into tok, straight from the source
+ *
+ * up to 19 significant digits are accumulated in a uint64_t,
+ * integers that fit in int64_t are exact in tok->i,
+ * short mantissas with small exponent are exact with one multiply
+ * or divide (Clinger's fast path), everything else goes to strtod
+ */
+static SjsonResult sjson_lexnum(const char *p, const char *end,
+                                sjsontok *tok) {
+    const char *start = p;
+    bool neg = false, isint = true, truncated = false;
+    uint64_t mantissa = 0;
+    int digits = 0, exp10 = 0;
+
+    if (p < end && (*p == '-' || *p == '+'))
+        neg = *p++ == '-';
+    if (p >= end || *p < '0' || *p > '9')
+        return SJSON_ERR_INVALID_SOURCE;
+    for (; p < end && *p >= '0' && *p <= '9'; p++) {
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            digits += mantissa != 0;
+        } else {
+            truncated = true;
+            exp10++;
+        }
+    }
+    if (p < end && *p == '.') {
+        isint = false;
+        if (++p >= end || *p < '0' || *p > '9')
+            return SJSON_ERR_INVALID_SOURCE;
+        for (; p < end && *p >= '0' && *p <= '9'; p++) {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                digits += mantissa != 0;
+                exp10--;
+            } else {
+                truncated = true;
+            }
+        }
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        bool expneg = false;
+        int e = 0;
+        isint = false;
+        if (++p < end && (*p == '-' || *p == '+'))
+            expneg = *p++ == '-';
+        if (p >= end || *p < '0' || *p > '9')
+            return SJSON_ERR_INVALID_SOURCE;
+        for (; p < end && *p >= '0' && *p <= '9'; p++)
+            if (e < 100000)
+                e = e * 10 + (*p - '0');
+        exp10 += expneg ? -e : e;
+    }
+
+    *tok = (sjsontok){SJSON_TKNUMBERLITERAL, start, p};
+    /* -0 is a double, int64_t has no negative zero */
+    if (isint && !truncated && !(neg && mantissa == 0) &&
+        mantissa <= (uint64_t)INT64_MAX + (neg ? 1 : 0)) {
+        tok->isint = true;
+        tok->i = neg ? (int64_t)(0 - mantissa) : (int64_t)mantissa;
+        tok->num = neg ? -(double)mantissa : (double)mantissa;
+    } else if (!truncated && mantissa <= (1ull << 53) && exp10 >= -22 &&
+               exp10 <= 22) {
+        double num = (double)mantissa;
+        num = exp10 < 0 ? num / sjson_pow10[-exp10] : num * sjson_pow10[exp10];
+        tok->num = neg ? -num : num;
+    } else {
+        tok->num = sjson_strtod(start, p);
+    }
+    return SJSON_SUCCESS;
+}
+
+static SjsonResult sjsonlexer_lexnumber(sjsonlexer *lexer, sjsontok *tok) {
+    SjsonResult ret = sjson_lexnum(lexer->c, lexer->end, tok);
+    if (ret == SJSON_SUCCESS)
+        lexer->c = tok->end;
+    return ret;
+}
+
+static int sjson_hexval(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/* 4 hex digits of \u escape at p */
+static bool sjson_hex4(const char *p, uint32_t *cp) {
+    *cp = 0;
+    for (int i = 0; i < 4; i++) {
+        int v = sjson_hexval(p[i]);
+        if (v < 0)
+            return false;
+        *cp = *cp << 4 | (uint32_t)v;
+    }
+    return true;
+}
+
+/* UTF-8 of code point cp into out, 1 to 4 bytes */
+static size_t sjson_utf8_encode(uint32_t cp, char *out) {
+    if (cp < 0x80) {
+        out[0] = (char)cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        out[0] = (char)(0xc0 | cp >> 6);
+        out[1] = (char)(0x80 | (cp & 0x3f));
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = (char)(0xe0 | cp >> 12);
+        out[1] = (char)(0x80 | (cp >> 6 & 0x3f));
+        out[2] = (char)(0x80 | (cp & 0x3f));
+        return 3;
+    }
+    out[0] = (char)(0xf0 | cp >> 18);
+    out[1] = (char)(0x80 | (cp >> 12 & 0x3f));
+    out[2] = (char)(0x80 | (cp >> 6 & 0x3f));
+    out[3] = (char)(0x80 | (cp & 0x3f));
+    return 4;
+}
+
+/**
+ * decode string body [c, end) into buf, which has room for end - c bytes
+ *
+ * runs without escapes are copied whole, \uXXXX becomes UTF-8, a
+ * surrogate pair one 4 byte sequence, a lone surrogate U+FFFD
+ */
+static SjsonResult sjson_decode(const char *c, const char *end, char *buf,
+                                size_t *outlen) {
+    size_t len = 0;
+    while (c < end) {
+        const char *bs = (const char *)memchr(c, '\\', end - c);
+        if (bs == NULL)
+            bs = end;
+        memcpy(buf + len, c, bs - c);
+        len += bs - c;
+        if (bs >= end - 1) {
+            if (bs < end)
+                return SJSON_ERR_INVALID_ESCAPE_SEQUENCE;
+            break;
+        }
+        c = bs + 2;
+        switch (bs[1]) {
+        case '\\':
+        case '\"':
+        case '/':
+            buf[len++] = bs[1];
+            break;
+        case 'b':
+            buf[len++] = '\b';
+            break;
+        case 'f':
+            buf[len++] = '\f';
+            break;
+        case 'n':
+            buf[len++] = '\n';
+            break;
+        case 'r':
+            buf[len++] = '\r';
+            break;
+        case 't':
+            buf[len++] = '\t';
+            break;
+        case 'u': {
+            uint32_t cp, lo;
+            if (end - c < 4 || !sjson_hex4(c, &cp))
+                return SJSON_ERR_INVALID_ESCAPE_SEQUENCE;
+            c += 4;
+            if (cp >= 0xd800 && cp < 0xdc00) {
+                if (end - c >= 6 && c[0] == '\\' && c[1] == 'u' &&
+                    sjson_hex4(c + 2, &lo) && lo >= 0xdc00 && lo < 0xe000) {
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                    c += 6;
+                } else {
+                    cp = 0xfffd;
+                }
+            } else if (cp >= 0xdc00 && cp < 0xe000) {
+                cp = 0xfffd;
+            }
+            len += sjson_utf8_encode(cp, buf + len);
+            break;
+        }
+        default:
+            return SJSON_ERR_INVALID_ESCAPE_SEQUENCE;
+        }
+    }
+    *outlen = len;
+    return SJSON_SUCCESS;
+}
+
+static SjsonResult sjsonlexer_lexstring(sjsonlexer *lexer, sjsontok *tok) {
+    const char *c = lexer->c + 1, *stringend = c;
+    bool escaped = false, nonascii = false;
+
+    /* find terminating double quote, need to escape \" */
+    while ((stringend = sjson_scanstringutf8(stringend, lexer->end,
+                                             &nonascii)) < lexer->end &&
+           stringend[0] == '\\') {
+        escaped = true;
+        stringend += 2;
+    }
+    if (stringend >= lexer->end)
+        return SJSON_ERR_NO_TERMINATING_DOUBLE_QUOTE;
+    /* pure ASCII strings, most of them, are not looked at again */
+    if (nonascii && (lexer->flags & SJSON_OPT_VALIDATE_UTF8) &&
+        !sjson_utf8_valid(c, stringend - c))
+        return SJSON_ERR_INVALID_UTF8;
+
+    /* nothing to decode, token is a slice of the source */
+    if (!escaped && (lexer->flags & SJSON_OPT_ZEROCOPY)) {
+        lexer->c = stringend + 1;
+        *tok = (sjsontok){SJSON_TKSTRINGLITERAL, c, stringend};
+        return SJSON_SUCCESS;
+    }
+
+    /* can't just point into source, escape character reasons,
+     * decoded string is never longer than its source */
+    char *buf = (char *)sjsonlexer_alloc(lexer, stringend - c + 1);
+    if (buf == NULL)
+        return SJSON_ERR_NO_MEMORY;
+    size_t len;
+    SjsonResult ret = sjson_decode(c, stringend, buf, &len);
+    if (ret) {
+        if (lexer->arena == NULL)
+            free(buf);
+        return ret;
+    }
+    buf[len] = '\x0';
+    lexer->c = stringend + 1;
+    *tok = (sjsontok){SJSON_TKSTRINGLITERAL, buf, buf + len};
+    return SJSON_SUCCESS;
+}
+
+static SjsonResult sjsonlexer_lexprimitive(sjsonlexer *lexer, sjsontok *tok) {
+    int type;
+    const char *word;
+    switch (lexer->c[0]) {
+    case 't':
+        type = SJSON_TKTRUE;
+        word = "true";
+        break;
+    case 'f':
+        type = SJSON_TKFALSE;
+        word = "false";
+        break;
+    case 'n':
+        type = SJSON_TKNULL;
+        word = "null";
+        break;
+    default:
+        return SJSON_ERR_WRONG_TYPE;
+    }
+    size_t len = strlen(word);
+    if ((size_t)(lexer->end - lexer->c) < len ||
+        memcmp(lexer->c, word, len) != 0)
+        return SJSON_ERR_INVALID_SOURCE;
+    *tok = (sjsontok){type, lexer->c, lexer->c + len};
+    lexer->c += len;
+    return SJSON_SUCCESS;
+}
+
+/* lex one token at lexer->c, SJSON_TKINVALID once source is exhausted */
+static SjsonResult sjsonlexer_next(sjsonlexer *lexer, sjsontok *tok) {
+    int type;
+    lexer->c = sjson_skipspace(lexer->c, lexer->end);
+    if (lexer->c >= lexer->end) {
+        *tok = (sjsontok){SJSON_TKINVALID, lexer->c, lexer->c};
+        return SJSON_SUCCESS;
+    }
+    switch (lexer->c[0]) {
+    case '[':
+        type = SJSON_TKLSQUAREBRACKET;
+        break;
+    case ']':
+        type = SJSON_TKRSQUAREBRACKET;
+        break;
+    case '{':
+        type = SJSON_TKLBRACE;
+        break;
+    case '}':
+        type = SJSON_TKRBRACE;
+        break;
+    case ',':
+        type = SJSON_TKCOMMA;
+        break;
+    case ':':
+        type = SJSON_TKCOLON;
+        break;
+    case '0':
+    case '1':
+    case '2':
+    case '3':
+    case '4':
+    case '5':
+    case '6':
+    case '7':
+    case '8':
+    case '9':
+    case '+':
+    case '-':
+        return sjsonlexer_lexnumber(lexer, tok);
+    case '\"':
+        return sjsonlexer_lexstring(lexer, tok);
+    case 'n':
+    case 't':
+    case 'f':
+        return sjsonlexer_lexprimitive(lexer, tok);
+    default:
+        return SJSON_ERR_UNKNOWN_TOKEN;
+    }
+    *tok = (sjsontok){type, lexer->c, lexer->c + 1};
+    lexer->c++;
+    return SJSON_SUCCESS;
+}
+
+/* states of sjson_pull, what the next token may be */
+enum {
+    SJSON_PULL_VALUE,      /* value, at start or after : or , in array */
+    SJSON_PULL_FIRSTVALUE, /* value or ], after [ */
+    SJSON_PULL_KEY,        /* key, after , in object */
+    SJSON_PULL_FIRSTKEY,   /* key or }, after { */
+    SJSON_PULL_COLON,      /* :, after key */
+    SJSON_PULL_COMMA,      /* , or end of container, after value */
+    SJSON_PULL_DONE,       /* end of input, after top-level value */
+};
+
+void sjson_pull_feed(sjson_pull *pull, const char *s, size_t len, bool last) {
+    pull->c = s, pull->end = s + len;
+    pull->last = last;
+}
+
+void sjson_pull_free(sjson_pull *pull) {
+    free(pull->pending.buf);
+    free(pull->str.buf);
+    free(pull->stack);
+    memset(pull, 0, sizeof(*pull));
+}
+
+static bool sjson_isnumchar(char c) {
+    return (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' ||
+           c == 'e' || c == 'E';
+}
+
+static bool sjson_iswordchar(char c) { return c >= 'a' && c <= 'z'; }
+
+/* closing quote of string body at p, end if not in this chunk,
+ * *escape carries a backslash that ended the previous chunk */
+static const char *sjson_pull_strend(const char *p, const char *end,
+                                     bool *escape) {
+    if (*escape && p < end) {
+        *escape = false;
+        p++;
+    }
+    while ((p = sjson_scanstring(p, end)) < end && *p == '\\') {
+        if (p + 1 == end) {
+            *escape = true;
+            return end;
+        }
+        p += 2;
+    }
+    return p;
+}
+
+/* lex complete scalar [s, end), a string includes both quotes */
+static SjsonResult sjson_pull_lex(sjson_pull *pull, const char *s,
+                                  const char *end, sjsontok *tok) {
+    SjsonResult ret;
+    if (*s == '\"') {
+        s++, end--;
+        if (memchr(s, '\\', end - s) == NULL) {
+            *tok = (sjsontok){SJSON_TKSTRINGLITERAL, s, end};
+            return SJSON_SUCCESS;
+        }
+        pull->str.len = 0;
+        if (sjsonbuf_reserve(&pull->str, end - s))
+            return SJSON_ERR_NO_MEMORY;
+        if ((ret = sjson_decode(s, end, pull->str.buf, &pull->str.len)))
+            return ret;
+        *tok = (sjsontok){SJSON_TKSTRINGLITERAL, pull->str.buf,
+                          pull->str.buf + pull->str.len};
+        return SJSON_SUCCESS;
+    }
+    if (sjson_iswordchar(*s)) {
+        sjsonlexer lexer;
+        sjsonlexer_init(&lexer, s, end - s);
+        if ((ret = sjsonlexer_lexprimitive(&lexer, tok)))
+            return ret;
+        return lexer.c == end ? SJSON_SUCCESS : SJSON_ERR_INVALID_SOURCE;
+    }
+    if ((ret = sjson_lexnum(s, end, tok)))
+        return ret;
+    return tok->end == end ? SJSON_SUCCESS : SJSON_ERR_INVALID_SOURCE;
+}
+
+/* next token, SJSON_ERR_NEED_INPUT if the chunk ends inside of it */
+static SjsonResult sjson_pull_token(sjson_pull *pull, sjsontok *tok) {
+    const char *p, *q, *end = pull->end;
+    bool complete;
+
+    if (pull->pending.len) {
+        /* continue token started in an earlier chunk */
+        char first = pull->pending.buf[0];
+        if (first == '\"') {
+            q = sjson_pull_strend(pull->c, end, &pull->escape);
+            complete = q < end;
+            if (complete)
+                q++;
+        } else {
+            bool (*in)(char) =
+                sjson_iswordchar(first) ? sjson_iswordchar : sjson_isnumchar;
+            for (q = pull->c; q < end && in(*q); q++)
+                ;
+            complete = q < end || pull->last;
+        }
+        if (sjsonbuf_push(&pull->pending, pull->c, q - pull->c))
+            return SJSON_ERR_NO_MEMORY;
+        pull->c = q;
+        if (!complete)
+            return pull->last ? SJSON_ERR_NO_TERMINATING_DOUBLE_QUOTE
+                              : SJSON_ERR_NEED_INPUT;
+        p = pull->pending.buf;
+        q = p + pull->pending.len;
+        pull->pending.len = 0;
+        return sjson_pull_lex(pull, p, q, tok);
+    }
+
+    p = pull->c = sjson_skipspace(pull->c, end);
+    if (p >= end) {
+        if (!pull->last)
+            return SJSON_ERR_NEED_INPUT;
+        *tok = (sjsontok){SJSON_TKINVALID, p, p};
+        return SJSON_SUCCESS;
+    }
+    switch (*p) {
+    case '\"':
+        q = sjson_pull_strend(p + 1, end, &pull->escape);
+        complete = q < end;
+        if (complete)
+            q++;
+        else if (pull->last)
+            return SJSON_ERR_NO_TERMINATING_DOUBLE_QUOTE;
+        break;
+    case 'n':
+    case 't':
+    case 'f':
+        for (q = p; q < end && sjson_iswordchar(*q); q++)
+            ;
+        complete = q < end || pull->last;
+        break;
+    case '0':
+    case '1':
+    case '2':
+    case '3':
+    case '4':
+    case '5':
+    case '6':
+    case '7':
+    case '8':
+    case '9':
+    case '+':
+    case '-':
+        for (q = p; q < end && sjson_isnumchar(*q); q++)
+            ;
+        complete = q < end || pull->last;
+        break;
+    default: {
+        /* single character token */
+        sjsonlexer lexer;
+        sjsonlexer_init(&lexer, p, 1);
+        pull->c = p + 1;
+        return sjsonlexer_next(&lexer, tok);
+    }
+    }
+    pull->c = q;
+    if (complete)
+        return sjson_pull_lex(pull, p, q, tok);
+    if (sjsonbuf_push(&pull->pending, p, q - p))
+        return SJSON_ERR_NO_MEMORY;
+    return SJSON_ERR_NEED_INPUT;
+}
+
+static SjsonResult sjson_pull_unterminated(sjson_pull *pull) {
+    if (pull->depth == 0)
+        return SJSON_ERR_INVALID_SOURCE;
+    return pull->stack[pull->depth - 1] == '{'
+               ? SJSON_ERR_NO_TERMINATING_BRACE
+               : SJSON_ERR_NO_TERMINATING_BRACKET;
+}
+
+/* state after a complete value */
+static void sjson_pull_endvalue(sjson_pull *pull) {
+    pull->state = pull->depth ? SJSON_PULL_COMMA : SJSON_PULL_DONE;
+}
+
+static SjsonResult sjson_pull_open(sjson_pull *pull, char c) {
+    if (pull->depth >= (pull->max_depth ? pull->max_depth : SJSON_MAX_DEPTH))
+        return SJSON_ERR_MAX_DEPTH;
+    if (pull->depth == pull->stackcap) {
+        size_t cap = pull->stackcap ? pull->stackcap * 2 : 32;
+        char *stack = (char *)realloc(pull->stack, cap);
+        if (stack == NULL)
+            return SJSON_ERR_NO_MEMORY;
+        pull->stack = stack;
+        pull->stackcap = cap;
+    }
+    pull->stack[pull->depth++] = c;
+    pull->state = c == '{' ? SJSON_PULL_FIRSTKEY : SJSON_PULL_FIRSTVALUE;
+    return SJSON_SUCCESS;
+}
+
+static SjsonResult sjson_pull_close(sjson_pull *pull) {
+    pull->depth--;
+    sjson_pull_endvalue(pull);
+    return SJSON_SUCCESS;
+}
+
+SjsonResult sjson_pull_next(sjson_pull *pull, sjson_event *ev) {
+    SjsonResult ret;
+    for (;;) {
+        sjsontok *tok = &ev->tok;
+        if ((ret = sjson_pull_token(pull, tok)))
+            return ret;
+        ev->iskey = false;
+        if (tok->type == SJSON_TKINVALID)
+            return pull->state == SJSON_PULL_DONE
+                       ? SJSON_SUCCESS
+                       : sjson_pull_unterminated(pull);
+
+        switch (pull->state) {
+        case SJSON_PULL_DONE:
+            return SJSON_ERR_INVALID_SOURCE;
+        case SJSON_PULL_FIRSTKEY:
+            if (tok->type == SJSON_TKRBRACE)
+                return sjson_pull_close(pull);
+            /* fallthrough */
+        case SJSON_PULL_KEY:
+            if (tok->type == SJSON_TKRBRACE)
+                return SJSON_ERR_TRAILING_COMMA;
+            if (tok->type != SJSON_TKSTRINGLITERAL)
+                return SJSON_ERR_INVALID_SOURCE;
+            ev->iskey = true;
+            pull->state = SJSON_PULL_COLON;
+            return SJSON_SUCCESS;
+        case SJSON_PULL_COLON:
+            if (tok->type != SJSON_TKCOLON)
+                return SJSON_ERR_NO_TERMINATING_BRACE;
+            pull->state = SJSON_PULL_VALUE;
+            continue;
+        case SJSON_PULL_COMMA: {
+            bool object = pull->stack[pull->depth - 1] == '{';
+            if (tok->type == SJSON_TKCOMMA) {
+                pull->state = object ? SJSON_PULL_KEY : SJSON_PULL_VALUE;
+                continue;
+            }
+            if (tok->type ==
+                (object ? SJSON_TKRBRACE : SJSON_TKRSQUAREBRACKET))
+                return sjson_pull_close(pull);
+            return sjson_pull_unterminated(pull);
+        }
+        case SJSON_PULL_FIRSTVALUE:
+            if (tok->type == SJSON_TKRSQUAREBRACKET)
+                return sjson_pull_close(pull);
+            /* fallthrough */
+        default:
+            switch (tok->type) {
+            case SJSON_TKLBRACE:
+                return sjson_pull_open(pull, '{');
+            case SJSON_TKLSQUAREBRACKET:
+                return sjson_pull_open(pull, '[');
+            case SJSON_TKSTRINGLITERAL:
+            case SJSON_TKNUMBERLITERAL:
+            case SJSON_TKTRUE:
+            case SJSON_TKFALSE:
+            case SJSON_TKNULL:
+                sjson_pull_endvalue(pull);
+                return SJSON_SUCCESS;
+            case SJSON_TKRSQUAREBRACKET:
+                if (pull->depth)
+                    return SJSON_ERR_TRAILING_COMMA;
+                /* fallthrough */
+            default:
+                return SJSON_ERR_INVALID_SOURCE;
+            }
+        }
+    }
+}
+
+sjson_result sjson_new(int type) {
+    sjson *json = (sjson *)calloc(1, sizeof(*json));
+    if (json == NULL) {
+        return (sjson_result){
+            .err = SJSON_ERR_NO_MEMORY,
+        };
+    }
+    json->type = type;
+    return (sjson_result){.json = json};
+}
+
+/* length of string value, terminated or not */
+static size_t sjson_strlen(const sjson *json) {
+    if (json->flags & SJSON_FLAG_STRLEN)
+        return json->x.len;
+    return strlen(json->v.str);
+}
+
+static size_t sjson_keylen(const sjson *json) {
+    if (json->flags & SJSON_FLAG_KEYLEN)
+        return json->keylen;
+    return strlen(json->key);
+}
+
+/* interned keys are equal when their pointers are */
+static bool sjson_keyeq(const sjson *json, const char *key, size_t len) {
+    return json->key != NULL && sjson_keylen(json) == len &&
+           (json->key == key || memcmp(json->key, key, len) == 0);
+}
+
+/* private: slot of open addressing table, hash of child's key */
+struct sjsonslot {
+    sjson *json;
+    uint64_t hash;
+};
+
+/* FNV-1a */
+static uint64_t sjson_hash(const char *s, size_t len) {
+    uint64_t h = 14695981039346656037ull;
+    while (len--)
+        h = (h ^ (unsigned char)*s++) * 1099511628211ull;
+    return h;
+}
+
+struct sjsoninternslot {
+    const char *key; /* NULL if empty */
+    size_t len;
+    uint64_t hash;
+};
+
+static bool sjson_intern_grow(sjson_intern *table) {
+    size_t cap = table->cap ? table->cap * 2 : 256;
+    struct sjsoninternslot *slots =
+        (struct sjsoninternslot *)calloc(cap, sizeof(*slots));
+    if (slots == NULL)
+        return false;
+    for (size_t i = 0; i < table->cap; i++) {
+        struct sjsoninternslot *old = &table->slots[i];
+        if (old->key == NULL)
+            continue;
+        size_t j = old->hash & (cap - 1);
+        while (slots[j].key != NULL)
+            j = (j + 1) & (cap - 1);
+        slots[j] = *old;
+    }
+    free(table->slots);
+    table->slots = slots;
+    table->cap = cap;
+    return true;
+}
+
+const char *sjson_intern_key(sjson_intern *table, const char *key,
+                             size_t len) {
+    uint64_t hash = sjson_hash(key, len);
+    struct sjsoninternslot *slot;
+    char *copy;
+    /* at most half full */
+    if (table->len * 2 >= table->cap && !sjson_intern_grow(table))
+        return NULL;
+    for (size_t i = hash & (table->cap - 1);; i = (i + 1) & (table->cap - 1)) {
+        slot = &table->slots[i];
+        if (slot->key == NULL)
+            break;
+        if (slot->hash == hash && slot->len == len &&
+            memcmp(slot->key, key, len) == 0)
+            return slot->key;
+    }
+    if ((copy = (char *)sjson_arena_alloc(&table->arena, len + 1)) == NULL)
+        return NULL;
+    memcpy(copy, key, len);
+    copy[len] = '\x0';
+    *slot = (struct sjsoninternslot){copy, len, hash};
+    table->len++;
+    return copy;
+}
+
+void sjson_intern_free(sjson_intern *table) {
+    free(table->slots);
+    sjson_arena_free(&table->arena);
+    *table = (sjson_intern){0};
+}
+
+static void *sjsonindex_alloc(sjsonindex *index, size_t size) {
+    if (index->arena)
+        return sjson_arena_alloc(index->arena, size);
+    return malloc(size);
+}
+
+static void sjsonindex_release(sjsonindex *index, void *p) {
+    if (!index->arena)
+        free(p);
+}
+
+/* drop lookup table, lookups fall back to linear scan until rebuilt */
+static void sjsonindex_drop(sjsonindex *index) {
+    sjsonindex_release(index, index->slots);
+    index->slots = NULL;
+    index->cap = index->len = index->dups = 0;
+}
+
+static void sjsonindex_dropitems(sjsonindex *index) {
+    sjsonindex_release(index, index->items);
+    index->items = NULL;
+    index->nitems = index->itemscap = 0;
+}
+
+static void sjsonindex_free(sjsonindex *index) {
+    if (index == NULL || index->arena)
+        return;
+    free(index->slots);
+    free(index->items);
+    free(index);
+}
+
+static bool sjsonindex_pushitem(sjsonindex *index, sjson *child) {
+    if (index->nitems == index->itemscap) {
+        size_t cap = index->itemscap ? index->itemscap * 2 : SJSON_INDEX_MIN;
+        sjson **items;
+        if (index->arena) {
+            /* old vector stays in the arena, total waste below 2x */
+            items = (sjson **)sjson_arena_alloc(index->arena,
+                                                cap * sizeof(*items));
+            if (items != NULL && index->nitems)
+                memcpy(items, index->items, index->nitems * sizeof(*items));
+        } else {
+            items = (sjson **)realloc(index->items, cap * sizeof(*items));
+        }
+        if (items == NULL)
+            return false;
+        index->items = items;
+        index->itemscap = cap;
+    }
+    index->items[index->nitems++] = child;
+    return true;
+}
+
+/* unindex array child, popping from the back is O(1) */
+static void sjsonindex_removeitem(sjsonindex *index, sjson *child) {
+    size_t i = index->nitems;
+    while (i > 0 && index->items[i - 1] != child)
+        i--;
+    if (i == 0)
+        return;
+    memmove(index->items + i - 1, index->items + i,
+            (index->nitems - i) * sizeof(*index->items));
+    index->nitems--;
+}
+
+/* slot holding key, or the empty slot where it would go */
+static struct sjsonslot *sjsonindex_probe(sjsonindex *index, const char *key,
+                                          size_t len, uint64_t hash) {
+    size_t mask = index->cap - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        struct sjsonslot *slot = &index->slots[i];
+        if (slot->json == NULL ||
+            (slot->hash == hash && sjson_keyeq(slot->json, key, len)))
+            return slot;
+    }
+}
+
+static bool sjsonindex_grow(sjsonindex *index, size_t cap) {
+    struct sjsonslot *old = index->slots;
+    size_t oldcap = index->cap;
+    struct sjsonslot *slots = (struct sjsonslot *)sjsonindex_alloc(
+        index, cap * sizeof(struct sjsonslot));
+    if (slots == NULL)
+        return false;
+    memset(slots, 0, cap * sizeof(struct sjsonslot));
+    index->slots = slots;
+    index->cap = cap;
+    for (size_t i = 0; i < oldcap; i++) {
+        if (old[i].json == NULL)
+            continue;
+        size_t j = old[i].hash & (cap - 1);
+        while (slots[j].json != NULL)
+            j = (j + 1) & (cap - 1);
+        slots[j] = old[i];
+    }
+    sjsonindex_release(index, old);
+    return true;
+}
+
+/* index child, only the first child with a given key is in the table */
+static bool sjsonindex_insert(sjsonindex *index, sjson *child) {
+    if (child->key == NULL)
+        return true;
+    if ((index->len + 1) * 2 > index->cap &&
+        !sjsonindex_grow(index, index->cap * 2))
+        return false;
+    size_t len = sjson_keylen(child);
+    uint64_t hash = sjson_hash(child->key, len);
+    struct sjsonslot *slot = sjsonindex_probe(index, child->key, len, hash);
+    if (slot->json != NULL) {
+        index->dups++;
+        return true;
+    }
+    slot->json = child;
+    slot->hash = hash;
+    index->len++;
+    return true;
+}
+
+/* unindex child, call before it is unlinked from its siblings */
+static void sjsonindex_remove(sjsonindex *index, sjson *child) {
+    if (child->key == NULL)
+        return;
+    size_t len = sjson_keylen(child), mask = index->cap - 1;
+    struct sjsonslot *slot = sjsonindex_probe(
+        index, child->key, len, sjson_hash(child->key, len));
+    if (slot->json != child) {
+        /* child was shadowed by an earlier one with the same key */
+        if (slot->json != NULL)
+            index->dups--;
+        return;
+    }
+
+    /* backward shift deletion, keeps probe chains without tombstones */
+    size_t i = slot - index->slots, j = i;
+    index->slots[i].json = NULL;
+    index->len--;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (index->slots[j].json == NULL)
+            break;
+        size_t k = index->slots[j].hash & mask;
+        if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+            index->slots[i] = index->slots[j];
+            index->slots[j].json = NULL;
+            i = j;
+        }
+    }
+
+    /* next child with that key takes its place */
+    if (index->dups) {
+        for (sjson *it = child->next; it != NULL; it = it->next) {
+            if (sjson_keyeq(it, child->key, len)) {
+                index->dups--;
+                if (!sjsonindex_insert(index, it))
+                    sjsonindex_drop(index);
+                break;
+            }
+        }
+    }
+}
+
+/* lookup table of object, built on first use once it is large enough */
+static sjsonindex *sjson_objectindex(sjson *json) {
+    sjsonindex *index = json->index;
+    size_t n = 0, cap = 32;
+    if (index != NULL && index->slots != NULL)
+        return index;
+    sjson_foreach(json, it) n++;
+    if (n < SJSON_INDEX_MIN)
+        return NULL;
+    if (index == NULL) {
+        /* arena nodes get their index from the parser, or not at all */
+        if (json->flags & SJSON_FLAG_ARENA)
+            return NULL;
+        if ((index = (sjsonindex *)calloc(1, sizeof(*index))) == NULL)
+            return NULL;
+        json->index = index;
+    }
+    while (cap < n * 2)
+        cap *= 2;
+    if (!sjsonindex_grow(index, cap))
+        return NULL;
+    sjson_foreach(json, it) {
+        if (!sjsonindex_insert(index, it)) {
+            sjsonindex_drop(index);
+            return NULL;
+        }
+    }
+    return index;
+}
+
+/* position vector of array, built on first use once it is large enough */
+static sjsonindex *sjson_arrayindex(sjson *json) {
+    sjsonindex *index = json->index;
+    size_t n = 0;
+    if (json->type != SJSON_ARRAY)
+        return NULL;
+    if (index != NULL && index->items != NULL)
+        return index;
+    sjson_foreach(json, it) n++;
+    if (n < SJSON_INDEX_MIN)
+        return NULL;
+    if (index == NULL) {
+        if (json->flags & SJSON_FLAG_ARENA)
+            return NULL;
+        if ((index = (sjsonindex *)calloc(1, sizeof(*index))) == NULL)
+            return NULL;
+        json->index = index;
+    }
+    sjson_foreach(json, it) {
+        if (!sjsonindex_pushitem(index, it)) {
+            sjsonindex_dropitems(index);
+            return NULL;
+        }
+    }
+    return index;
+}
+
+/* i-th child of container, NULL if out of range */
+static sjson *sjson_array_find(sjson *json, size_t i) {
+    sjsonindex *index = sjson_arrayindex(json);
+    size_t x = 0;
+    if (index != NULL)
+        return i < index->nitems ? index->items[i] : NULL;
+    sjson_foreach(json, iter) if (x++ == i) return iter;
+    return NULL;
+}
+
+/* first child of object with key */
+static sjson *sjson_object_find(sjson *json, const char *key, size_t len) {
+    sjsonindex *index = sjson_objectindex(json);
+    if (index != NULL)
+        return sjsonindex_probe(index, key, len, sjson_hash(key, len))->json;
+    sjson_foreach(json, iter) if (sjson_keyeq(iter, key, len)) return iter;
+    return NULL;
+}
+
+void sjson_free(sjson *json) {
+    /* children are spliced in front of the siblings left to free, so
+     * neither depth nor width takes any stack */
+    while (json != NULL) {
+        sjson *next = json->next;
+        if (json->flags & SJSON_FLAG_ARENA)
+            return;
+        if (sjson_child(json) != NULL) {
+            json->x.tail->next = next;
+            next = json->v.child;
+        }
+        sjsonindex_free(json->index);
+        if (json->flags & SJSON_FLAG_OWNSTR)
+            free((void *)json->v.str);
+        if (json->flags & SJSON_FLAG_OWNKEY)
+            free((void *)json->key);
+        free(json);
+        json = next;
+    }
+}
+
+/* double capacity of a stack that starts out in the array local, NULL
+ * if out of memory, items are left as they are then */
+static void *sjson_stackgrow(void *items, size_t *cap, size_t size,
+                             const void *local) {
+    void *grown = items == local ? malloc(*cap * 2 * size)
+                                 : realloc(items, *cap * 2 * size);
+    if (grown == NULL)
+        return NULL;
+    if (items == local)
+        memcpy(grown, local, *cap * size);
+    *cap *= 2;
+    return grown;
+}
+
+
+void sjson_touch(sjson *json) {
+    /* ancestors of a dirty node are already dirty */
+    for (; json != NULL && !(json->flags & SJSON_FLAG_DIRTY);
+         json = json->parent)
+        if (json->flags & SJSON_FLAG_CACHED)
+            json->flags |= SJSON_FLAG_DIRTY;
+}
+
+/* append child to children of container json */
+static void sjson_link(sjson *json, sjson *child) {
+    if (json->x.tail == NULL && json->v.child == NULL) {
+        json->x.tail = json->v.child = child;
+    } else {
+        json->x.tail->next = child;
+        child->prev = json->x.tail;
+        json->x.tail = child;
+    }
+    child->parent = json;
+    if (json->index != NULL && json->index->slots != NULL &&
+        !sjsonindex_insert(json->index, child))
+        sjsonindex_drop(json->index);
+    if (json->index != NULL && json->index->items != NULL &&
+        !sjsonindex_pushitem(json->index, child))
+        sjsonindex_dropitems(json->index);
+}
+
+/* move parser to next token */
+static SjsonResult sjsonparser_advance(sjsonparser *parser) {
+    return sjsonlexer_next(&parser->lexer, &parser->tok);
+}
+
+/* node for the parser, from its arena if it has one */
+static sjson_result sjson_newnode(sjsonparser *parser, int type) {
+    if (parser->lexer.arena == NULL)
+        return sjson_new(type);
+    sjson *json =
+        (sjson *)sjson_arena_alloc(parser->lexer.arena, sizeof(*json));
+    if (json == NULL) {
+        return (sjson_result){
+            .err = SJSON_ERR_NO_MEMORY,
+        };
+    }
+    memset(json, 0, sizeof(*json));
+    json->type = type;
+    json->flags = SJSON_FLAG_ARENA;
+    return (sjson_result){.json = json};
+}
+
+/* string token was decoded into its own malloced buffer */
+static bool sjsonparser_ownsstr(sjsonparser *parser, sjsontok *tok) {
+    return parser->lexer.arena == NULL &&
+           !(tok->start >= parser->lexer.start &&
+             tok->start < parser->lexer.end);
+}
+
+/* syntax error at current token, free its string if nobody took it */
+static void sjsonparser_droptok(sjsonparser *parser) {
+    if (parser->tok.type == SJSON_TKSTRINGLITERAL &&
+        sjsonparser_ownsstr(parser, &parser->tok))
+        free((void *)parser->tok.start);
+    parser->tok.type = SJSON_TKINVALID;
+}
+
+/* parsing failed after json was created, drop partial tree */
+static sjson_result sjson_parsefail(sjson *json, SjsonResult err) {
+    sjson_free(json);
+    return (sjson_result){.err = err};
+}
+
+/* arena containers can't allocate later, leave large ones a stub to
+ * build their index in on first access, SJSON_ERR_NO_MEMORY if the stub
+ * could not be allocated, large containers then go without an index */
+static SjsonResult sjsonparser_indexstub(sjsonparser *parser, sjson *json,
+                                         size_t n) {
+    if (parser->lexer.arena != NULL && n >= SJSON_INDEX_MIN) {
+        sjsonindex *index = (sjsonindex *)sjson_arena_alloc(
+            parser->lexer.arena, sizeof(*index));
+        if (index == NULL)
+            return SJSON_ERR_NO_MEMORY;
+        memset(index, 0, sizeof(*index));
+        index->arena =
+            parser->lexer.home ? parser->lexer.home : parser->lexer.arena;
+        json->index = index;
+    }
+    return SJSON_SUCCESS;
+}
+
+/* lazy container at current token, only its span is kept */
+static sjson_result sjson_parselazy(sjsonparser *parser) {
+    bool object = parser->tok.type == SJSON_TKLBRACE;
+    const char *start = parser->tok.start;
+    const char *end = sjson_skipvalue(start, parser->lexer.end);
+    SjsonResult err;
+    if (end == NULL)
+        return (sjson_result){.err = object ? SJSON_ERR_NO_TERMINATING_BRACE
+                                            : SJSON_ERR_NO_TERMINATING_BRACKET};
+    sjson_result ret =
+        sjson_newnode(parser, object ? SJSON_OBJECT : SJSON_ARRAY);
+    if (ret.err)
+        return ret;
+    ret.json->v.str = start;
+    ret.json->x.len = end - start;
+    ret.json->flags |= SJSON_FLAG_LAZY;
+    /* the stub remembers the arena to expand into, without it children
+     * would be malloced and never freed with the arena */
+    if ((err = sjsonparser_indexstub(parser, ret.json, SJSON_INDEX_MIN)))
+        return sjson_parsefail(ret.json, err);
+    parser->lexer.c = end;
+    if ((err = sjsonparser_advance(parser)))
+        return sjson_parsefail(ret.json, err);
+    return ret;
+}
+
+/* scalar at current token, leaving parser after it */
+static sjson_result sjson_parsescalar(sjsonparser *parser) {
+    sjson_result ret;
+    SjsonResult err;
+    switch (parser->tok.type) {
+    case SJSON_TKTRUE:
+        ret = sjson_newnode(parser, SJSON_TRUE);
+        break;
+    case SJSON_TKFALSE:
+        ret = sjson_newnode(parser, SJSON_FALSE);
+        break;
+    case SJSON_TKNULL:
+        ret = sjson_newnode(parser, SJSON_NULL);
+        break;
+    case SJSON_TKNUMBERLITERAL:
+        ret = sjson_newnode(parser, SJSON_NUMBER);
+        if (ret.err)
+            return ret;
+        ret.json->v.num = parser->tok.num;
+        if (parser->tok.isint) {
+            ret.json->x.i = parser->tok.i;
+            ret.json->flags |= SJSON_FLAG_INT;
+        }
+        break;
+    case SJSON_TKSTRINGLITERAL:
+        ret = sjson_newnode(parser, SJSON_STRING);
+        if (ret.err) {
+            if (sjsonparser_ownsstr(parser, &parser->tok))
+                free((void *)parser->tok.start);
+            return ret;
+        }
+        ret.json->v.str = parser->tok.start;
+        ret.json->x.len = parser->tok.end - parser->tok.start;
+        ret.json->flags |= SJSON_FLAG_STRLEN;
+        if (sjsonparser_ownsstr(parser, &parser->tok))
+            ret.json->flags |= SJSON_FLAG_OWNSTR;
+        break;
+    default:
+        return (sjson_result){
+            .err = SJSON_ERR_UNKNOWN_TOKEN,
+        };
+    }
+    if (ret.err)
+        return ret;
+    if ((err = sjsonparser_advance(parser)))
+        return sjson_parsefail(ret.json, err);
+    return ret;
+}
+
+/* like sjson_stackgrow, with an arena the old stack is left in it so
+ * that a reused arena is all a deep document needs */
+static void *sjsonparser_growstack(sjsonparser *parser, void *items,
+                                   size_t *cap, size_t size,
+                                   const void *local) {
+    if (parser->lexer.arena == NULL)
+        return sjson_stackgrow(items, cap, size, local);
+    void *grown = sjson_arena_alloc(parser->lexer.arena, *cap * 2 * size);
+    if (grown == NULL)
+        return NULL;
+    memcpy(grown, items, *cap * size);
+    *cap *= 2;
+    return grown;
+}
+
+/* replace key by its copy in the parser's intern table, if any */
+static SjsonResult sjsonparser_internkey(sjsonparser *parser, sjsontok *key,
+                                        bool *ownskey) {
+    if (parser->lexer.intern == NULL)
+        return SJSON_SUCCESS;
+    const char *k = sjson_intern_key(parser->lexer.intern, key->start,
+                                     key->end - key->start);
+    if (*ownskey)
+        free((void *)key->start);
+    *ownskey = false;
+    if (k == NULL)
+        return SJSON_ERR_NO_MEMORY;
+    key->end = k + (key->end - key->start);
+    key->start = k;
+    return SJSON_SUCCESS;
+}
+
+/* container being parsed by sjson_parsevalue */
+struct sjsonparseframe {
+    sjson *json;
+    size_t n; /* children so far */
+};
+
+/* parse value starting at current token, leaving parser after it,
+ * open containers are kept on an explicit stack, not the call stack.
+ * with eager, a lazy parser still builds the outermost container */
+static sjson_result sjson_parsevalue(sjsonparser *parser, bool eager) {
+    struct sjsonparseframe local[32], *stack = local;
+    size_t depth = 0, cap = sizeof(local) / sizeof(*local);
+    sjson *root = NULL;
+    sjsontok key = {0};
+    bool ownskey = false;
+    SjsonResult err;
+
+    for (;;) {
+        int type = parser->tok.type;
+        bool open = type == SJSON_TKLBRACE || type == SJSON_TKLSQUAREBRACKET;
+        bool lazy = (parser->lexer.flags & SJSON_OPT_LAZY) &&
+                    !(eager && root == NULL);
+        sjson_result val;
+        if (open && !lazy) {
+            if (depth >= parser->lexer.maxdepth) {
+                err = SJSON_ERR_MAX_DEPTH;
+                goto fail;
+            }
+            val = sjson_newnode(parser, type == SJSON_TKLBRACE ? SJSON_OBJECT
+                                                                : SJSON_ARRAY);
+        } else if (open) {
+            val = sjson_parselazy(parser);
+        } else {
+            val = sjson_parsescalar(parser);
+        }
+        if (val.err) {
+            err = val.err;
+            goto fail;
+        }
+
+        /* link at once, failing later frees it along with root */
+        if (depth == 0) {
+            root = val.json;
+        } else {
+            struct sjsonparseframe *top = &stack[depth - 1];
+            if (top->json->type == SJSON_OBJECT) {
+                val.json->key = key.start;
+                val.json->keylen = key.end - key.start;
+                val.json->flags |= SJSON_FLAG_KEYLEN;
+                if (ownskey)
+                    val.json->flags |= SJSON_FLAG_OWNKEY;
+                ownskey = false;
+            }
+            sjson_link(top->json, val.json);
+            top->n++;
+        }
+
+        bool opened = open && !lazy;
+        if (opened) {
+            if (depth == cap) {
+                struct sjsonparseframe *grown =
+                    (struct sjsonparseframe *)sjsonparser_growstack(
+                        parser, stack, &cap, sizeof(*stack), local);
+                if (grown == NULL) {
+                    err = SJSON_ERR_NO_MEMORY;
+                    goto fail;
+                }
+                stack = grown;
+            }
+            stack[depth++] = (struct sjsonparseframe){val.json, 0};
+            if ((err = sjsonparser_advance(parser)))
+                goto fail;
+        }
+
+        /* close finished containers, then step over a comma */
+        while (depth > 0) {
+            struct sjsonparseframe *top = &stack[depth - 1];
+            bool object = top->json->type == SJSON_OBJECT;
+            int close = object ? SJSON_TKRBRACE : SJSON_TKRSQUAREBRACKET;
+            if (parser->tok.type == close) {
+                if ((err = sjsonparser_advance(parser)))
+                    goto fail;
+                sjsonparser_indexstub(parser, top->json, top->n);
+                depth--;
+                opened = false;
+                continue;
+            }
+            if (opened)
+                break;
+            if (parser->tok.type != SJSON_TKCOMMA) {
+                err = object ? SJSON_ERR_NO_TERMINATING_BRACE
+                             : SJSON_ERR_NO_TERMINATING_BRACKET;
+                sjsonparser_droptok(parser);
+                goto fail;
+            }
+            if ((err = sjsonparser_advance(parser)))
+                goto fail;
+            if (parser->tok.type == close) {
+                err = SJSON_ERR_TRAILING_COMMA;
+                goto fail;
+            }
+            break;
+        }
+        if (depth == 0)
+            break;
+
+        /* member key and colon, value is next round */
+        if (stack[depth - 1].json->type == SJSON_OBJECT) {
+            if (parser->tok.type != SJSON_TKSTRINGLITERAL) {
+                err = SJSON_ERR_INVALID_SOURCE;
+                goto fail;
+            }
+            key = parser->tok;
+            ownskey = sjsonparser_ownsstr(parser, &key);
+            if ((err = sjsonparser_internkey(parser, &key, &ownskey)))
+                goto fail;
+            if ((err = sjsonparser_advance(parser)))
+                goto fail;
+            if (parser->tok.type != SJSON_TKCOLON) {
+                err = SJSON_ERR_NO_TERMINATING_BRACE;
+                sjsonparser_droptok(parser);
+                goto fail;
+            }
+            if ((err = sjsonparser_advance(parser)))
+                goto fail;
+        }
+    }
+    if (stack != local && parser->lexer.arena == NULL)
+        free(stack);
+    return (sjson_result){.json = root};
+
+fail:
+    if (ownskey)
+        free((void *)key.start);
+    if (stack != local && parser->lexer.arena == NULL)
+        free(stack);
+    if (root != NULL)
+        sjson_free(root);
+    return (sjson_result){.err = err};
+}
+
+static sjson_result sjson_parse(sjsonparser *parser) {
+    return sjson_parsevalue(parser, false);
+}
+
+SjsonResult sjson_replace(sjson *parent, sjson *oldsibling,
+                              sjson *newsibling) {
+    if (!oldsibling || !newsibling)
+        return SJSON_ERR_NULL_REFERENCE;
+    if (parent && sjson_child(parent) != NULL) {
+        sjsonindex *index = parent->index;
+        if (parent->x.tail == oldsibling)
+            parent->x.tail = newsibling;
+        if (parent->v.child == oldsibling)
+            parent->v.child = newsibling;
+        if (index != NULL && index->slots != NULL)
+            sjsonindex_drop(index);
+        if (index != NULL && index->items != NULL) {
+            for (size_t i = 0; i < index->nitems; i++)
+                if (index->items[i] == oldsibling)
+                    index->items[i] = newsibling;
+        }
+    }
+    if (oldsibling->prev)
+        oldsibling->prev->next = newsibling;
+    if (oldsibling->next)
+        oldsibling->next->prev = newsibling;
+    newsibling->prev = oldsibling->prev;
+    newsibling->next = oldsibling->next;
+    newsibling->parent = parent;
+    newsibling->flags &= ~(SJSON_FLAG_CACHED | SJSON_FLAG_DIRTY);
+    sjson_touch(parent);
+    /* sjson_free would take the siblings along */
+    oldsibling->prev = oldsibling->next = NULL;
+    sjson_free(oldsibling);
+    return SJSON_SUCCESS;
+}
+
+SjsonResult sjson_deletechild(sjson *json, sjson *child) {
+    if (sjson_child(json) == NULL)
+        return SJSON_ERR_NO_MATCHING_MEMBER;
+    if (json->index != NULL && json->index->slots != NULL)
+        sjsonindex_remove(json->index, child);
+    if (json->index != NULL && json->index->items != NULL)
+        sjsonindex_removeitem(json->index, child);
+    if (json->x.tail == child) {
+        if (json->v.child == child)
+            json->x.tail = json->v.child = NULL;
+        else
+            json->x.tail = child->prev;
+    } else if (json->v.child == child) {
+        json->v.child = child->next;
+    }
+    if (child->prev)
+        child->prev->next = child->next;
+    if (child->next)
+        child->next->prev = child->prev;
+    child->parent = NULL;
+    sjson_touch(json);
+    return SJSON_SUCCESS;
+}
+
+SjsonResult sjson_expand(sjson *json) {
+    sjsonparser parser;
+    sjson_result tmp;
+    SjsonResult ret;
+    if (!(json->flags & SJSON_FLAG_LAZY))
+        return SJSON_SUCCESS;
+    sjsonlexer_init(&parser.lexer, json->v.str, json->x.len);
+    parser.lexer.arena = json->index ? json->index->arena : NULL;
+    parser.lexer.flags = SJSON_OPT_ZEROCOPY | SJSON_OPT_LAZY;
+    if ((ret = sjsonparser_advance(&parser)))
+        return ret;
+    /* the container itself is parsed eagerly, its children lazily */
+    tmp = sjson_parsevalue(&parser, true);
+    if (tmp.err)
+        return tmp.err;
+    if (parser.tok.type != SJSON_TKINVALID) {
+        sjsonparser_droptok(&parser);
+        sjson_free(tmp.json);
+        return SJSON_ERR_INVALID_SOURCE;
+    }
+    /* the children take the place of the source */
+    json->v.child = tmp.json->v.child;
+    json->x.tail = tmp.json->x.tail;
+    json->flags &= ~SJSON_FLAG_LAZY;
+    sjson_foreach(json, it) it->parent = json;
+    if (json->index == NULL)
+        json->index = tmp.json->index;
+    else
+        sjsonindex_free(tmp.json->index);
+    if (!(tmp.json->flags & SJSON_FLAG_ARENA))
+        free(tmp.json);
+    return SJSON_SUCCESS;
+}
+
+sjson_result sjson_object_get(sjson *json, char *key) {
+    SjsonResult ret;
+    if (json->type != SJSON_OBJECT)
+        return (sjson_result){.err = SJSON_ERR_WRONG_TYPE};
+    if ((ret = sjson_expand(json)))
+        return (sjson_result){.err = ret};
+    sjson *child = sjson_object_find(json, key, strlen(key));
+    if (child != NULL)
+        return (sjson_result){.json = child};
+    return (sjson_result){
+        .err = SJSON_ERR_NO_MATCHING_MEMBER,
+    };
+}
+
+SjsonResult sjson_object_delete_all(sjson *json, char *key) {
+    SjsonResult ret;
+    if (json->type != SJSON_OBJECT)
+        return SJSON_ERR_WRONG_TYPE;
+    if ((ret = sjson_expand(json)))
+        return ret;
+    size_t len = strlen(key);
+    sjsonindex *index = sjson_objectindex(json);
+    sjson *child;
+    /* without duplicate keys the index finds the only match */
+    if (index != NULL && index->dups == 0) {
+        if ((child = sjson_object_find(json, key, len)) != NULL)
+            sjson_deletechild(json, child);
+        return SJSON_SUCCESS;
+    }
+    sjson_foreach(json, iter) if (sjson_keyeq(iter, key, len))
+        sjson_deletechild(json, iter);
+    return SJSON_SUCCESS;
+}
+
+SjsonResult sjson_object_set(sjson *json, char *key, sjson *value) {
+    if (json->type != SJSON_OBJECT)
+        return SJSON_ERR_WRONG_TYPE;
+    sjson_object_delete_all(json, key);
+    if (value->flags & SJSON_FLAG_OWNKEY)
+        free((void *)value->key);
+    value->flags &= ~(SJSON_FLAG_OWNKEY | SJSON_FLAG_KEYLEN);
+    value->key = key;
+    sjson_addchild(json, value);
+    return SJSON_SUCCESS;
+}
+
+SjsonResult sjson_addchild(sjson *json, sjson *child) {
+    SjsonResult ret;
+    if (json->type != SJSON_OBJECT && json->type != SJSON_ARRAY)
+        return SJSON_ERR_WRONG_TYPE;
+    if ((ret = sjson_expand(json)))
+        return ret;
+    /* its cached bytes, if any, belong to where it came from */
+    child->flags &= ~(SJSON_FLAG_CACHED | SJSON_FLAG_DIRTY);
+    sjson_link(json, child);
+    sjson_touch(json);
+    return SJSON_SUCCESS;
+}
+
+sjson_result sjson_array_get(sjson *json, size_t i) {
+    SjsonResult ret = sjson_expand(json);
+    if (ret)
+        return (sjson_result){.err = ret};
+    sjson *child = sjson_array_find(json, i);
+    if (child != NULL)
+        return (sjson_result){.json = child};
+    return (sjson_result){
+        .err = SJSON_ERR_NO_MATCHING_MEMBER,
+    };
+}
+
+SjsonResult sjson_array_set(sjson *json, size_t i, sjson *x) {
+    SjsonResult ret = sjson_expand(json);
+    if (ret)
+        return ret;
+    sjson *it = sjson_array_find(json, i);
+    if (it == NULL)
+        return SJSON_ERR_NO_MATCHING_MEMBER;
+    return sjson_replace(json, it, x);
+}
+
+SjsonResult sjson_array_delete(sjson *json, size_t i) {
+    SjsonResult ret = sjson_expand(json);
+    if (ret)
+        return ret;
+    sjson *it = sjson_array_find(json, i);
+    if (it == NULL)
+        return SJSON_ERR_NO_MATCHING_MEMBER;
+    return sjson_deletechild(json, it);
+}
+
+sjson_result sjson_deserialize_ex(const char *s, size_t len,
+                                  const sjson_options *opt) {
+    sjsonparser parser;
+    sjson_result json;
+    SjsonResult ret;
+    sjsonlexer_init(&parser.lexer, s, len);
+    if (opt) {
+        parser.lexer.arena = opt->arena;
+        parser.lexer.flags = opt->flags;
+        parser.lexer.intern = opt->intern;
+        if (opt->max_depth)
+            parser.lexer.maxdepth = opt->max_depth;
+        /* expansion can't know whether the source was meant to be kept */
+        if (opt->flags & SJSON_OPT_LAZY)
+            parser.lexer.flags |= SJSON_OPT_ZEROCOPY;
+        /* skipped subtrees are never lexed */
+        if ((opt->flags & SJSON_OPT_LAZY) &&
+            (opt->flags & SJSON_OPT_VALIDATE_UTF8) &&
+            !sjson_utf8_valid(s, len))
+            return (sjson_result){.err = SJSON_ERR_INVALID_UTF8};
+    }
+    if ((ret = sjsonparser_advance(&parser)))
+        return (sjson_result){.err = ret};
+    json = sjson_parse(&parser);
+    if (json.err)
+        return (sjson_result){.err = json.err};
+    if (parser.tok.type != SJSON_TKINVALID) {
+        sjsonparser_droptok(&parser);
+        return sjson_parsefail(json.json, SJSON_ERR_INVALID_SOURCE);
+    }
+    return json;
+}
+
+sjson_result sjson_parser_parse(sjson_parser *parser, const char *s,
+                                size_t len) {
+    sjson_options opt = parser->opt;
+    sjson_arena_reset(&parser->arena);
+    opt.arena = &parser->arena;
+    return sjson_deserialize_ex(s, len, &opt);
+}
+
+void sjson_parser_free(sjson_parser *parser) {
+    sjson_arena_free(&parser->arena);
+}
+
+sjson_result sjson_deserialize_arena(sjson_arena *arena, const char *s,
+                                     size_t len) {
+    sjson_options opt = {.arena = arena};
+    return sjson_deserialize_ex(s, len, &opt);
+}
+
+sjson_result sjson_deserialize(const char *s, size_t len) {
+    return sjson_deserialize_ex(s, len, NULL);
+}
+
+struct sjsonquerystep {
+    const char *key; /* segment, unescaped */
+    size_t keylen;
+    size_t index;    /* array index, if isindex */
+    bool isindex;    /* segment is all digits */
+};
+
+SjsonResult sjson_query_compile(const char *path, sjson_query *q) {
+    bool pointer = path[0] == '\x0' || path[0] == '/';
+    char sep = pointer ? '/' : '.';
+    size_t pathlen = strlen(path), n = 0;
+    const char *p;
+    char *keys;
+
+    *q = (sjson_query){0};
+    if (pathlen == 0)
+        return SJSON_SUCCESS;
+    if (pointer)
+        path++, pathlen--;
+    n = 1;
+    for (p = path; *p; p++)
+        n += *p == sep;
+    /* steps, then their unescaped keys */
+    q->steps = (struct sjsonquerystep *)malloc(n * sizeof(*q->steps) +
+                                               pathlen + 1);
+    if (q->steps == NULL)
+        return SJSON_ERR_NO_MEMORY;
+    keys = (char *)(q->steps + n);
+    q->len = n;
+    for (size_t i = 0; i < n; i++) {
+        struct sjsonquerystep *step = &q->steps[i];
+        step->key = keys;
+        for (; *path && *path != sep; path++) {
+            if (pointer && *path == '~') {
+                path++;
+                if (*path != '0' && *path != '1') {
+                    sjson_query_free(q);
+                    return SJSON_ERR_INVALID_ESCAPE_SEQUENCE;
+                }
+                *keys++ = *path == '0' ? '~' : '/';
+            } else {
+                *keys++ = *path;
+            }
+        }
+        step->keylen = keys - step->key;
+        path += *path == sep;
+
+        /* RFC 6901 array index, no leading zeros */
+        step->isindex = step->keylen > 0 &&
+                        (step->key[0] != '0' || step->keylen == 1) &&
+                        step->keylen < 20;
+        step->index = 0;
+        for (size_t j = 0; step->isindex && j < step->keylen; j++) {
+            if (step->key[j] < '0' || step->key[j] > '9')
+                step->isindex = false;
+            else
+                step->index = step->index * 10 + (step->key[j] - '0');
+        }
+    }
+    return SJSON_SUCCESS;
+}
+
+void sjson_query_free(sjson_query *q) {
+    free(q->steps);
+    *q = (sjson_query){0};
+}
+
+/* raw key [s, end) without quotes equals step key */
+static bool sjson_query_keyeq(const struct sjsonquerystep *step,
+                              const char *s, const char *end) {
+    char buf[256], *decoded = buf;
+    size_t len;
+    bool eq;
+    if (memchr(s, '\\', end - s) == NULL)
+        return (size_t)(end - s) == step->keylen &&
+               memcmp(s, step->key, step->keylen) == 0;
+    /* escapes only ever shrink a key */
+    if ((size_t)(end - s) < step->keylen)
+        return false;
+    if ((size_t)(end - s) > sizeof(buf) &&
+        (decoded = (char *)malloc(end - s)) == NULL)
+        return false;
+    eq = sjson_decode(s, end, decoded, &len) == SJSON_SUCCESS &&
+         len == step->keylen && memcmp(decoded, step->key, len) == 0;
+    if (decoded != buf)
+        free(decoded);
+    return eq;
+}
+
+/* value of member or element step in container at p */
+static SjsonResult sjson_query_step(const struct sjsonquerystep *step,
+                                    const char **pp, const char *end) {
+    const char *p = *pp;
+    bool object = *p == '{';
+    size_t i = 0;
+    char close = object ? '}' : ']';
+
+    if (*p != '{' && *p != '[')
+        return SJSON_ERR_WRONG_TYPE;
+    if (!object && !step->isindex)
+        return SJSON_ERR_NO_MATCHING_MEMBER;
+    p = sjson_skipspace(p + 1, end);
+    if (p < end && *p == close)
+        return SJSON_ERR_NO_MATCHING_MEMBER;
+    for (;; i++) {
+        bool match;
+        if (object) {
+            const char *key = p, *keyend;
+            if (p >= end || *p != '\"' ||
+                (keyend = sjson_skipstring(p + 1, end)) == NULL)
+                return SJSON_ERR_INVALID_SOURCE;
+            match = sjson_query_keyeq(step, key + 1, keyend - 1);
+            p = sjson_skipspace(keyend, end);
+            if (p >= end || *p != ':')
+                return SJSON_ERR_NO_TERMINATING_BRACE;
+            p = sjson_skipspace(p + 1, end);
+        } else {
+            match = i == step->index;
+        }
+        if (p >= end)
+            return SJSON_ERR_INVALID_SOURCE;
+        if (match) {
+            *pp = p;
+            return SJSON_SUCCESS;
+        }
+        if ((p = sjson_skipvalue(p, end)) == NULL)
+            return object ? SJSON_ERR_NO_TERMINATING_BRACE
+                          : SJSON_ERR_NO_TERMINATING_BRACKET;
+        p = sjson_skipspace(p, end);
+        if (p < end && *p == close)
+            return SJSON_ERR_NO_MATCHING_MEMBER;
+        if (p >= end || *p != ',')
+            return object ? SJSON_ERR_NO_TERMINATING_BRACE
+                          : SJSON_ERR_NO_TERMINATING_BRACKET;
+        p = sjson_skipspace(p + 1, end);
+    }
+}
+
+SjsonResult sjson_query_find(const sjson_query *q, const char *s, size_t len,
+                             const char **value, size_t *valuelen) {
+    const char *end = s + len, *p = sjson_skipspace(s, end), *valueend;
+    SjsonResult ret;
+    if (p >= end)
+        return SJSON_ERR_INVALID_SOURCE;
+    for (size_t i = 0; i < q->len; i++)
+        if ((ret = sjson_query_step(&q->steps[i], &p, end)))
+            return ret;
+    if ((valueend = sjson_skipvalue(p, end)) == NULL || valueend == p)
+        return SJSON_ERR_INVALID_SOURCE;
+    *value = p;
+    *valuelen = valueend - p;
+    return SJSON_SUCCESS;
+}
+
+sjson_result sjson_query_get(const sjson_query *q, const char *s, size_t len,
+                             const sjson_options *opt) {
+    const char *value;
+    size_t valuelen;
+    SjsonResult ret = sjson_query_find(q, s, len, &value, &valuelen);
+    if (ret)
+        return (sjson_result){.err = ret};
+    return sjson_deserialize_ex(value, valuelen, opt);
+}
+
+/* map or read whole file into file */
+static SjsonResult sjson_file_open(const char *path, sjson_file *file) {
+    *file = (sjson_file){0};
+#ifdef SJSON_HAVE_FD
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return SJSON_ERR_READ;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return SJSON_ERR_READ;
+    }
+    if (st.st_size > 0) {
+        void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            close(fd);
+            return SJSON_ERR_READ;
+        }
+#ifdef POSIX_MADV_SEQUENTIAL
+        posix_madvise(p, st.st_size, POSIX_MADV_SEQUENTIAL);
+#endif
+        file->data = (const char *)p;
+        file->len = st.st_size;
+        file->mapped = true;
+    }
+    close(fd);
+    return SJSON_SUCCESS;
+#else
+    sjsonbuf buf = {0};
+    char chunk[4096];
+    size_t n;
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+        return SJSON_ERR_READ;
+    while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+        if (sjsonbuf_push(&buf, chunk, n)) {
+            free(buf.buf);
+            fclose(fp);
+            return SJSON_ERR_NO_MEMORY;
+        }
+    }
+    if (ferror(fp)) {
+        free(buf.buf);
+        fclose(fp);
+        return SJSON_ERR_READ;
+    }
+    fclose(fp);
+    file->data = buf.buf;
+    file->len = buf.len;
+    return SJSON_SUCCESS;
+#endif /* SJSON_HAVE_FD */
+}
+
+void sjson_file_close(sjson_file *file) {
+#ifdef SJSON_HAVE_FD
+    if (file->mapped)
+        munmap((void *)file->data, file->len);
+    else
+#endif /* SJSON_HAVE_FD */
+        free((void *)file->data);
+    *file = (sjson_file){0};
+}
+
+sjson_result sjson_deserialize_file(const char *path, const sjson_options *opt,
+                                    sjson_file *file) {
+    sjson_result json;
+    SjsonResult ret = sjson_file_open(path, file);
+    if (ret)
+        return (sjson_result){.err = ret};
+    json = sjson_deserialize_ex(file->data, file->len, opt);
+    /* only zero-copy strings and lazy containers still need the source */
+    if (json.err || opt == NULL ||
+        !(opt->flags & (SJSON_OPT_ZEROCOPY | SJSON_OPT_LAZY)))
+        sjson_file_close(file);
+    return json;
+}
+
+/* default worker count, online cores */
+static int sjson_ncpu(void) {
+#ifdef SJSON_HAVE_FD
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#else
+    return 1;
+#endif
+}
+
+typedef struct sjsonworker {
+    void (*fn)(void *ctx, int i);
+    void *ctx;
+    int i;
+} sjsonworker;
+
+#ifdef SJSON_HAVE_THREADS
+static void *sjsonworker_run(void *arg) {
+    sjsonworker *w = (sjsonworker *)arg;
+    w->fn(w->ctx, w->i);
+    return NULL;
+}
+#endif /* SJSON_HAVE_THREADS */
+
+/* run fn(ctx, i) for every i in [0, n), concurrently when threads are
+ * available, part 0 on the calling thread, parts whose thread could not
+ * be started too */
+static void sjson_parallel(int n, void (*fn)(void *ctx, int i), void *ctx) {
+#ifdef SJSON_HAVE_THREADS
+    sjsonworker *w = NULL;
+    pthread_t *tids = NULL;
+    bool *started = NULL;
+    if (n > 1) {
+        w = (sjsonworker *)malloc(n * sizeof(*w));
+        tids = (pthread_t *)malloc(n * sizeof(*tids));
+        started = (bool *)calloc(n, sizeof(*started));
+    }
+    if (w && tids && started) {
+        for (int i = 1; i < n; i++) {
+            w[i] = (sjsonworker){fn, ctx, i};
+            started[i] =
+                pthread_create(&tids[i], NULL, sjsonworker_run, &w[i]) == 0;
+        }
+        fn(ctx, 0);
+        for (int i = 1; i < n; i++) {
+            if (started[i])
+                pthread_join(tids[i], NULL);
+            else
+                fn(ctx, i);
+        }
+        free(w);
+        free(tids);
+        free(started);
+        return;
+    }
+    free(w);
+    free(tids);
+    free(started);
+#endif /* SJSON_HAVE_THREADS */
+    for (int i = 0; i < n; i++)
+        fn(ctx, i);
+}
+
+/* end of record starting at p, first newline outside a string */
+static const char *sjson_lineend(const char *p, const char *end) {
+    while ((p = sjson_scanline(p, end)) < end && *p == '"') {
+        /* skip string, a missing closing quote runs to end */
+        while ((p = sjson_scanstring(p + 1, end)) < end && *p == '\\')
+            p++;
+        if (p < end)
+            p++;
+        else
+            break;
+    }
+    return p;
+}
+
+typedef struct sjsonbatchjob {
+    sjson_batch *batch;
+    const char **spans; /* start, end of each record */
+    size_t *first;      /* records [first[i], first[i + 1]) of worker i */
+    int flags;
+    size_t maxdepth;
+} sjsonbatchjob;
+
+static void sjsonbatchjob_run(void *ctx, int w) {
+    sjsonbatchjob *job = (sjsonbatchjob *)ctx;
+    sjson_options opt = {.flags = job->flags,
+                         .arena = &job->batch->arenas[w],
+                         .max_depth = job->maxdepth};
+    for (size_t i = job->first[w]; i < job->first[w + 1]; i++) {
+        const char *s = job->spans[2 * i], *end = job->spans[2 * i + 1];
+        job->batch->records[i] = sjson_deserialize_ex(s, end - s, &opt);
+    }
+}
+
+SjsonResult sjson_deserialize_lines(const char *s, size_t len, int threads,
+                                    const sjson_options *opt,
+                                    sjson_batch *batch) {
+    const char *end = s + len, *p;
+    const char **spans = NULL;
+    size_t n = 0, cap = 0, *first;
+    sjsonbatchjob job;
+
+    *batch = (sjson_batch){0};
+    /* split, blank lines are no records */
+    for (p = s; p < end; p++) {
+        const char *start = sjson_skipspace(p, end);
+        if (start >= end)
+            break;
+        p = sjson_lineend(start, end);
+        if (n == cap) {
+            cap = cap ? cap * 2 : 256;
+            const char **grown =
+                (const char **)realloc(spans, 2 * cap * sizeof(*spans));
+            if (grown == NULL) {
+                free(spans);
+                return SJSON_ERR_NO_MEMORY;
+            }
+            spans = grown;
+        }
+        spans[2 * n] = start;
+        spans[2 * n + 1] = p;
+        n++;
+    }
+
+    if (threads <= 0)
+        threads = sjson_ncpu();
+    if ((size_t)threads > len / SJSON_THREAD_MIN)
+        threads = (int)(len / SJSON_THREAD_MIN);
+    if ((size_t)threads > n)
+        threads = (int)n;
+    if (threads < 1)
+        threads = 1;
+
+    batch->records = (sjson_result *)malloc((n ? n : 1) * sizeof(sjson_result));
+    batch->arenas = (sjson_arena *)calloc(threads, sizeof(sjson_arena));
+    first = (size_t *)malloc((threads + 1) * sizeof(*first));
+    if (batch->records == NULL || batch->arenas == NULL || first == NULL) {
+        free(spans);
+        free(first);
+        sjson_batch_free(batch);
+        return SJSON_ERR_NO_MEMORY;
+    }
+    batch->len = n;
+    batch->narenas = threads;
+
+    /* contiguous runs of records with about the same number of bytes */
+    first[0] = 0;
+    for (int w = 1; w < threads; w++) {
+        const char *split = s + len / threads * w;
+        size_t i = first[w - 1];
+        while (i < n && spans[2 * i] < split)
+            i++;
+        first[w] = i;
+    }
+    first[threads] = n;
+
+    job = (sjsonbatchjob){batch, spans, first, opt ? opt->flags : 0,
+                          opt ? opt->max_depth : 0};
+    sjson_parallel(threads, sjsonbatchjob_run, &job);
+    free(spans);
+    free(first);
+    return SJSON_SUCCESS;
+}
+
+void sjson_batch_free(sjson_batch *batch) {
+    for (size_t i = 0; i < batch->narenas; i++)
+        sjson_arena_free(&batch->arenas[i]);
+    free(batch->arenas);
+    free(batch->records);
+    *batch = (sjson_batch){0};
+}
+
+/* elements of one slice of a top-level array, linked but parentless */
+struct sjsonslice {
+    const char *start, *end;
+    sjson *child, *tail;
+    size_t n;
+    SjsonResult err;
+};
+
+typedef struct sjsonarrayjob {
+    struct sjsonslice *slices;
+    sjson_arena *arenas; /* one per worker, NULL without opt->arena */
+    sjson_arena *home;   /* opt->arena, they end up merged into it */
+    sjson *root;         /* the array, parent of every element */
+    int flags;
+    size_t maxdepth;
+    int last; /* slice ending with the closing bracket */
+} sjsonarrayjob;
+
+static void sjsonarrayjob_run(void *ctx, int w) {
+    sjsonarrayjob *job = (sjsonarrayjob *)ctx;
+    struct sjsonslice *slice = &job->slices[w];
+    sjsonparser parser;
+    sjsonlexer_init(&parser.lexer, slice->start, slice->end - slice->start);
+    parser.lexer.arena = job->arenas ? &job->arenas[w] : NULL;
+    parser.lexer.home = job->home;
+    parser.lexer.flags = job->flags;
+    /* elements are one level down */
+    parser.lexer.maxdepth = job->maxdepth - 1;
+    if ((slice->err = sjsonparser_advance(&parser)))
+        return;
+    for (;;) {
+        sjson_result child = sjson_parse(&parser);
+        if (child.err) {
+            slice->err = child.err;
+            break;
+        }
+        child.json->prev = slice->tail;
+        child.json->parent = job->root;
+        if (slice->tail)
+            slice->tail->next = child.json;
+        else
+            slice->child = child.json;
+        slice->tail = child.json;
+        slice->n++;
+
+        if (parser.tok.type == SJSON_TKCOMMA) {
+            if ((slice->err = sjsonparser_advance(&parser)))
+                break;
+            continue;
+        }
+        if (w == job->last && parser.tok.type == SJSON_TKRSQUAREBRACKET &&
+            !(slice->err = sjsonparser_advance(&parser)) &&
+            parser.tok.type == SJSON_TKINVALID)
+            return;
+        if (w != job->last && parser.tok.type == SJSON_TKINVALID)
+            return;
+        if (!slice->err)
+            slice->err = SJSON_ERR_INVALID_SOURCE;
+        sjsonparser_droptok(&parser);
+        break;
+    }
+    if (slice->child)
+        sjson_free(slice->child);
+    slice->child = slice->tail = NULL;
+}
+
+/* blocks of src go behind the current block of dst, which keeps
+ * allocating from it */
+static void sjson_arena_merge(sjson_arena *dst, sjson_arena *src) {
+    struct sjsonarenablock *oldest = src->head;
+    if (oldest == NULL)
+        return;
+    while (oldest->prev != NULL)
+        oldest = oldest->prev;
+    if (dst->head == NULL) {
+        dst->head = src->head;
+    } else {
+        oldest->prev = dst->head->prev;
+        dst->head->prev = src->head;
+    }
+    src->head = NULL;
+}
+
+sjson_result sjson_deserialize_parallel(const char *s, size_t len,
+                                        int threads,
+                                        const sjson_options *opt) {
+    const char *end = s + len, *p = sjson_skipspace(s, end);
+    struct sjsonslice *slices = NULL;
+    const char **cuts = NULL;
+    sjson_arena *arenas = NULL;
+    sjsonarrayjob job;
+    sjsonparser parser;
+    sjson_result ret = {0};
+    size_t count = 0;
+    int n;
+
+    if (threads <= 0)
+        threads = sjson_ncpu();
+    if ((size_t)threads > len / SJSON_THREAD_MIN)
+        threads = (int)(len / SJSON_THREAD_MIN);
+    if (threads < 2 || p >= end || *p != '[' ||
+        (opt && (opt->intern || (opt->flags & SJSON_OPT_LAZY))))
+        return sjson_deserialize_ex(s, len, opt);
+
+    cuts = (const char **)malloc((threads - 1) * sizeof(*cuts));
+    slices = (struct sjsonslice *)calloc(threads, sizeof(*slices));
+    if (opt && opt->arena)
+        arenas = (sjson_arena *)calloc(threads, sizeof(*arenas));
+    if (cuts == NULL || slices == NULL || (opt && opt->arena && !arenas))
+        goto serial;
+    n = sjson_arraycuts(p, end, threads, cuts) + 1;
+    if (n < 2)
+        goto serial;
+    for (int i = 0; i < n; i++) {
+        slices[i].start = i ? cuts[i - 1] + 1 : p + 1;
+        slices[i].end = i < n - 1 ? cuts[i] : end;
+    }
+
+    /* in the first worker's arena, the main one is not thread-safe */
+    sjsonlexer_init(&parser.lexer, s, len);
+    parser.lexer.arena = arenas;
+    ret = sjson_newnode(&parser, SJSON_ARRAY);
+    if (ret.err)
+        goto serial;
+    job = (sjsonarrayjob){slices, arenas, opt ? opt->arena : NULL, ret.json,
+                          opt ? opt->flags : 0, SJSON_MAX_DEPTH, n - 1};
+    if (opt && opt->max_depth)
+        job.maxdepth = opt->max_depth;
+    sjson_parallel(n, sjsonarrayjob_run, &job);
+    for (int i = 0; i < n; i++)
+        if (slices[i].err)
+            goto serial;
+
+    parser.lexer.arena = opt ? opt->arena : NULL;
+    for (int i = 0; i < n; i++) {
+        struct sjsonslice *slice = &slices[i];
+        if (slice->child == NULL)
+            continue;
+        slice->child->prev = ret.json->x.tail;
+        if (ret.json->x.tail)
+            ret.json->x.tail->next = slice->child;
+        else
+            ret.json->v.child = slice->child;
+        ret.json->x.tail = slice->tail;
+        count += slice->n;
+    }
+    for (int i = 0; arenas && i < n; i++)
+        sjson_arena_merge(opt->arena, &arenas[i]);
+    sjsonparser_indexstub(&parser, ret.json, count);
+    free(cuts);
+    free(slices);
+    free(arenas);
+    return ret;
+
+serial:
+    /* also reports parse errors exactly as a single thread would */
+    if (ret.json != NULL && !arenas)
+        free(ret.json);
+    for (int i = 0; slices && i < threads; i++)
+        if (slices[i].child && !arenas)
+            sjson_free(slices[i].child);
+    for (int i = 0; arenas && i < threads; i++)
+        sjson_arena_free(&arenas[i]);
+    free(cuts);
+    free(slices);
+    free(arenas);
+    return sjson_deserialize_ex(s, len, opt);
+}
+
+/* open containers and finished children not yet moved to their block */
+typedef struct sjsoncompactstack {
+    sjson_compact *nodes;
+    size_t len, cap;
+    size_t *open; /* index in nodes of every open container */
+    size_t depth, opencap;
+} sjsoncompactstack;
+
+static sjson_compact *sjsoncompactstack_push(sjsoncompactstack *st, int type) {
+    if (st->len == st->cap) {
+        size_t cap = st->cap ? st->cap * 2 : 256;
+        sjson_compact *nodes =
+            (sjson_compact *)realloc(st->nodes, cap * sizeof(*nodes));
+        if (nodes == NULL)
+            return NULL;
+        st->nodes = nodes;
+        st->cap = cap;
+    }
+    memset(&st->nodes[st->len], 0, sizeof(sjson_compact));
+    st->nodes[st->len].type = (uint16_t)type;
+    return &st->nodes[st->len++];
+}
+
+static SjsonResult sjsoncompactstack_open(sjsoncompactstack *st, int type) {
+    if (st->depth == st->opencap) {
+        size_t cap = st->opencap ? st->opencap * 2 : 32;
+        size_t *open = (size_t *)realloc(st->open, cap * sizeof(*open));
+        if (open == NULL)
+            return SJSON_ERR_NO_MEMORY;
+        st->open = open;
+        st->opencap = cap;
+    }
+    st->open[st->depth++] = st->len;
+    return sjsoncompactstack_push(st, type) ? SJSON_SUCCESS
+                                            : SJSON_ERR_NO_MEMORY;
+}
+
+/* move children of innermost open container to one block in arena */
+static SjsonResult sjsoncompactstack_close(sjsoncompactstack *st,
+                                           sjson_arena *arena) {
+    size_t i = st->open[--st->depth], n = st->len - i - 1;
+    sjson_compact *json = &st->nodes[i];
+    if (n > UINT32_MAX)
+        return SJSON_ERR_INVALID_SOURCE;
+    if (n) {
+        json->v.child = (sjson_compact *)sjson_arena_alloc(
+            arena, n * sizeof(sjson_compact));
+        if (json->v.child == NULL)
+            return SJSON_ERR_NO_MEMORY;
+        memcpy(json->v.child, json + 1, n * sizeof(sjson_compact));
+    }
+    json->len = (uint32_t)(json->type == SJSON_OBJECT ? n / 2 : n);
+    st->len = i + 1;
+    return SJSON_SUCCESS;
+}
+
+SjsonResult sjson_compact_deserialize(sjson_arena *arena, const char *s,
+                                      size_t len, int flags,
+                                      sjson_compact **root) {
+    sjson_pull pull = {0};
+    sjsoncompactstack st = {0};
+    sjson_event ev;
+    SjsonResult ret;
+
+    if ((flags & SJSON_OPT_VALIDATE_UTF8) && !sjson_utf8_valid(s, len))
+        return SJSON_ERR_INVALID_UTF8;
+    sjson_pull_feed(&pull, s, len, true);
+    while (!(ret = sjson_pull_next(&pull, &ev)) &&
+           ev.tok.type != SJSON_TKINVALID) {
+        sjson_compact *json = NULL;
+        switch (ev.tok.type) {
+        case SJSON_TKLBRACE:
+            ret = sjsoncompactstack_open(&st, SJSON_OBJECT);
+            break;
+        case SJSON_TKLSQUAREBRACKET:
+            ret = sjsoncompactstack_open(&st, SJSON_ARRAY);
+            break;
+        case SJSON_TKRBRACE:
+        case SJSON_TKRSQUAREBRACKET:
+            ret = sjsoncompactstack_close(&st, arena);
+            break;
+        case SJSON_TKSTRINGLITERAL: {
+            const char *str = ev.tok.start;
+            size_t n = ev.tok.end - ev.tok.start;
+            if (n > UINT32_MAX) {
+                ret = SJSON_ERR_INVALID_SOURCE;
                 break;
             }
-        } else {
-            sjsonbuf_push(&buf, &ch, 1);
+            /* decoded strings live in the pull parser until next event */
+            if (!(flags & SJSON_OPT_ZEROCOPY) || str < s || str >= s + len) {
+                char *copy = (char *)sjson_arena_alloc(arena, n + 1);
+                if (copy == NULL) {
+                    ret = SJSON_ERR_NO_MEMORY;
+                    break;
+                }
+                memcpy(copy, str, n);
+                copy[n] = '\x0';
+                str = copy;
+            }
+            if ((json = sjsoncompactstack_push(&st, SJSON_STRING)) == NULL) {
+                ret = SJSON_ERR_NO_MEMORY;
+                break;
+            }
+            json->v.str = str;
+            json->len = (uint32_t)n;
+            break;
+        }
+        case SJSON_TKNUMBERLITERAL:
+            if ((json = sjsoncompactstack_push(&st, SJSON_NUMBER)) == NULL) {
+                ret = SJSON_ERR_NO_MEMORY;
+                break;
+            }
+            if (ev.tok.isint) {
+                json->flags = SJSON_FLAG_INT;
+                json->v.i = ev.tok.i;
+            } else {
+                json->v.num = ev.tok.num;
+            }
+            break;
+        default:
+            if (sjsoncompactstack_push(&st, ev.tok.type == SJSON_TKTRUE
+                                                ? SJSON_TRUE
+                                            : ev.tok.type == SJSON_TKFALSE
+                                                ? SJSON_FALSE
+                                                : SJSON_NULL) == NULL)
+                ret = SJSON_ERR_NO_MEMORY;
+            break;
+        }
+        if (ret)
+            break;
+    }
+    if (ret == SJSON_ERR_NEED_INPUT)
+        ret = SJSON_ERR_INVALID_SOURCE;
+    if (!ret) {
+        *root = (sjson_compact *)sjson_arena_alloc(arena, sizeof(**root));
+        if (*root == NULL)
+            ret = SJSON_ERR_NO_MEMORY;
+        else
+            **root = st.nodes[0];
+    }
+    sjson_pull_free(&pull);
+    free(st.nodes);
+    free(st.open);
+    return ret;
+}
+
+SjsonResult sjson_compact_object_get(const sjson_compact *json,
+                                     const char *key, sjson_compact **child) {
+    size_t len = strlen(key);
+    if (json->type != SJSON_OBJECT)
+        return SJSON_ERR_WRONG_TYPE;
+    sjson_compact_foreach(json, it) {
+        if (it[-1].len == len && memcmp(it[-1].v.str, key, len) == 0) {
+            *child = it;
+            return SJSON_SUCCESS;
         }
     }
-    sjsonlexer_pushtok(lexer, SJSON_TKSTRINGLITERAL, buf.buf,
-                       buf.buf + buf.len);
+    return SJSON_ERR_NO_MATCHING_MEMBER;
+}
+
+SjsonResult sjson_compact_array_get(const sjson_compact *json, size_t i,
+                                    sjson_compact **child) {
+    if (json->type != SJSON_ARRAY)
+        return SJSON_ERR_WRONG_TYPE;
+    if (i >= json->len)
+        return SJSON_ERR_NO_MATCHING_MEMBER;
+    *child = &json->v.child[i];
     return SJSON_SUCCESS;
 }
 
-SjsonResult sjsonlexer_lexprimitive(sjsonlexer *lexer) {
-    int type;
-    ptrdiff_t len;
-    switch (sjsonlexer_peek(lexer)) {
+#define SJSON_TAPE_MAGIC "SJTAPE1"
+#define SJSON_TAPE_PAYLOAD(w) ((w) & 0xffffffffffffffull)
+#define SJSON_TAPE_TYPE(w) ((char)((w) >> 56))
+
+/* header of a tape file, followed by the words, then the strings */
+struct sjsontapehdr {
+    char magic[8];
+    uint64_t order; /* 1, or byte swapped if written on other endianness */
+    uint64_t len, strlen;
+};
+
+static SjsonResult sjson_tape_push(sjsonbuf *words, char type,
+                                   uint64_t payload) {
+    uint64_t w = (uint64_t)(unsigned char)type << 56 | payload;
+    return sjsonbuf_push(words, &w, sizeof(w));
+}
+
+/* string arena entry: uint32_t length, bytes, NUL */
+static SjsonResult sjson_tape_pushstr(sjsonbuf *words, sjsonbuf *strings,
+                                      char type, const char *s, size_t len) {
+    uint32_t n = (uint32_t)len;
+    SjsonResult ret;
+    if (len > UINT32_MAX)
+        return SJSON_ERR_INVALID_SOURCE;
+    /* offset has to fit the payload */
+    if (strings->len > SJSON_TAPE_PAYLOAD(UINT64_MAX))
+        return SJSON_ERR_NO_MEMORY;
+    if ((ret = sjson_tape_push(words, type, strings->len)) ||
+        (ret = sjsonbuf_push(strings, &n, sizeof(n))) ||
+        (ret = sjsonbuf_push(strings, s, len)) ||
+        (ret = sjsonbuf_push(strings, "", 1)))
+        return ret;
+    return SJSON_SUCCESS;
+}
+
+SjsonResult sjson_tape_build(const char *s, size_t len, sjson_tape *tape) {
+    sjson_pull pull = {0};
+    sjson_event ev;
+    sjsonbuf words = {0}, strings = {0};
+    /* index, child count of every open container */
+    size_t *stack = NULL, depth = 0, cap = 0;
+    SjsonResult ret;
+
+    *tape = (sjson_tape){0};
+    sjson_pull_feed(&pull, s, len, true);
+    while (!(ret = sjson_pull_next(&pull, &ev)) &&
+           ev.tok.type != SJSON_TKINVALID) {
+        size_t i = words.len / sizeof(uint64_t);
+        /* word indexes are stored in 32 bits, a close stores i + 1 */
+        if (i >= UINT32_MAX) {
+            ret = SJSON_ERR_NO_MEMORY;
+            break;
+        }
+        if (depth && !ev.iskey && ev.tok.type != SJSON_TKRBRACE &&
+            ev.tok.type != SJSON_TKRSQUAREBRACKET)
+            stack[2 * depth - 1]++;
+        switch (ev.tok.type) {
+        case SJSON_TKLBRACE:
+        case SJSON_TKLSQUAREBRACKET:
+            if (depth == cap) {
+                size_t *grown;
+                cap = cap ? cap * 2 : 32;
+                grown = (size_t *)realloc(stack, 2 * cap * sizeof(*stack));
+                if (grown == NULL) {
+                    ret = SJSON_ERR_NO_MEMORY;
+                    break;
+                }
+                stack = grown;
+            }
+            stack[2 * depth] = i;
+            stack[2 * depth + 1] = 0;
+            depth++;
+            /* payload is patched once the close is seen */
+            ret = sjson_tape_push(&words, *ev.tok.start, 0);
+            break;
+        case SJSON_TKRBRACE:
+        case SJSON_TKRSQUAREBRACKET: {
+            size_t open = stack[2 * depth - 2], n = stack[2 * depth - 1];
+            uint64_t *w;
+            depth--;
+            if ((ret = sjson_tape_push(&words, *ev.tok.start, open)))
+                break;
+            w = (uint64_t *)words.buf + open;
+            *w |= (uint64_t)(n < 0xffffff ? n : 0xffffff) << 32 | (i + 1);
+            break;
+        }
+        case SJSON_TKSTRINGLITERAL:
+            ret = sjson_tape_pushstr(&words, &strings, ev.iskey ? 'k' : '\"',
+                                     ev.tok.start, ev.tok.end - ev.tok.start);
+            break;
+        case SJSON_TKNUMBERLITERAL: {
+            uint64_t bits;
+            if (ev.tok.isint)
+                memcpy(&bits, &ev.tok.i, sizeof(bits));
+            else
+                memcpy(&bits, &ev.tok.num, sizeof(bits));
+            if (!(ret = sjson_tape_push(&words, ev.tok.isint ? 'l' : 'd', 0)))
+                ret = sjsonbuf_push(&words, &bits, sizeof(bits));
+            break;
+        }
+        case SJSON_TKTRUE:
+            ret = sjson_tape_push(&words, 't', 0);
+            break;
+        case SJSON_TKFALSE:
+            ret = sjson_tape_push(&words, 'f', 0);
+            break;
+        default:
+            ret = sjson_tape_push(&words, 'n', 0);
+            break;
+        }
+        if (ret)
+            break;
+    }
+    if (ret == SJSON_ERR_NEED_INPUT)
+        ret = SJSON_ERR_INVALID_SOURCE;
+    sjson_pull_free(&pull);
+    free(stack);
+    if (ret) {
+        free(words.buf);
+        free(strings.buf);
+        return ret;
+    }
+    tape->words = (const uint64_t *)words.buf;
+    tape->len = words.len / sizeof(uint64_t);
+    tape->strings = strings.buf;
+    tape->strlen = strings.len;
+    return SJSON_SUCCESS;
+}
+
+SjsonResult sjson_tape_write(const sjson_tape *tape, sjson_writefn write,
+                             void *ctx) {
+    struct sjsontapehdr hdr = {SJSON_TAPE_MAGIC, 1, tape->len, tape->strlen};
+    if (write(ctx, (const char *)&hdr, sizeof(hdr)) ||
+        write(ctx, (const char *)tape->words,
+              tape->len * sizeof(uint64_t)) ||
+        (tape->strlen && write(ctx, tape->strings, tape->strlen)))
+        return SJSON_ERR_WRITE;
+    return SJSON_SUCCESS;
+}
+
+SjsonResult sjson_tape_open(const char *path, sjson_tape *tape) {
+    struct sjsontapehdr hdr;
+    SjsonResult ret;
+    *tape = (sjson_tape){0};
+    if ((ret = sjson_file_open(path, &tape->file)))
+        return ret;
+    if (tape->file.len < sizeof(hdr))
+        goto fail;
+    memcpy(&hdr, tape->file.data, sizeof(hdr));
+    if (memcmp(hdr.magic, SJSON_TAPE_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.order != 1 || hdr.len == 0 ||
+        hdr.len > (tape->file.len - sizeof(hdr)) / sizeof(uint64_t) ||
+        hdr.strlen != tape->file.len - sizeof(hdr) - hdr.len * sizeof(uint64_t))
+        goto fail;
+    tape->words = (const uint64_t *)(tape->file.data + sizeof(hdr));
+    tape->len = hdr.len;
+    tape->strings = (const char *)(tape->words + hdr.len);
+    tape->strlen = hdr.strlen;
+    return SJSON_SUCCESS;
+fail:
+    sjson_file_close(&tape->file);
+    return SJSON_ERR_READ;
+}
+
+void sjson_tape_free(sjson_tape *tape) {
+    if (tape->file.data != NULL) {
+        sjson_file_close(&tape->file);
+    } else {
+        free((void *)tape->words);
+        free((void *)tape->strings);
+    }
+    *tape = (sjson_tape){0};
+}
+
+int sjson_tape_type(const sjson_tape *tape, size_t v) {
+    switch (SJSON_TAPE_TYPE(tape->words[v])) {
+    case '{':
+        return SJSON_OBJECT;
+    case '[':
+        return SJSON_ARRAY;
+    case 'k':
+    case '\"':
+        return SJSON_STRING;
+    case 'l':
+    case 'd':
+        return SJSON_NUMBER;
     case 't':
-        type = SJSON_TKTRUE;
-        len = 4;
-        break;
+        return SJSON_TRUE;
     case 'f':
-        type = SJSON_TKFALSE;
-        len = 5;
-        break;
+        return SJSON_FALSE;
     case 'n':
-        type = SJSON_TKNULL;
-        len = 4;
-        break;
+        return SJSON_NULL;
+    default:
+        return SJSON_INVALID;
+    }
+}
+
+const char *sjson_tape_str(const sjson_tape *tape, size_t v, size_t *len) {
+    const char *entry = tape->strings + SJSON_TAPE_PAYLOAD(tape->words[v]);
+    uint32_t n;
+    memcpy(&n, entry, sizeof(n));
+    if (len != NULL)
+        *len = n;
+    return entry + sizeof(n);
+}
+
+double sjson_tape_num(const sjson_tape *tape, size_t v) {
+    int64_t i;
+    double num;
+    if (SJSON_TAPE_TYPE(tape->words[v]) == 'l') {
+        memcpy(&i, &tape->words[v + 1], sizeof(i));
+        return (double)i;
+    }
+    memcpy(&num, &tape->words[v + 1], sizeof(num));
+    return num;
+}
+
+int64_t sjson_tape_int(const sjson_tape *tape, size_t v) {
+    int64_t i;
+    if (SJSON_TAPE_TYPE(tape->words[v]) != 'l')
+        return (int64_t)sjson_tape_num(tape, v);
+    memcpy(&i, &tape->words[v + 1], sizeof(i));
+    return i;
+}
+
+/* word index past value v */
+static size_t sjson_tape_skip(const sjson_tape *tape, size_t v) {
+    switch (SJSON_TAPE_TYPE(tape->words[v])) {
+    case '{':
+    case '[':
+        return (size_t)(tape->words[v] & 0xffffffff);
+    case 'l':
+    case 'd':
+        return v + 2;
+    default:
+        return v + 1;
+    }
+}
+
+size_t sjson_tape_count(const sjson_tape *tape, size_t v) {
+    size_t n = (size_t)(SJSON_TAPE_PAYLOAD(tape->words[v]) >> 32);
+    if (n < 0xffffff)
+        return n;
+    n = 0;
+    sjson_tape_foreach(tape, v, it) n++;
+    return n;
+}
+
+size_t sjson_tape_first(const sjson_tape *tape, size_t v) {
+    char type = SJSON_TAPE_TYPE(tape->words[v]);
+    if ((type != '{' && type != '[') || sjson_tape_skip(tape, v) == v + 2)
+        return 0;
+    return type == '{' ? v + 2 : v + 1;
+}
+
+size_t sjson_tape_next(const sjson_tape *tape, size_t v) {
+    size_t i = sjson_tape_skip(tape, v);
+    switch (SJSON_TAPE_TYPE(tape->words[i])) {
+    case '}':
+    case ']':
+        return 0;
+    case 'k':
+        return i + 1;
     default:
+        return i;
+    }
+}
+
+const char *sjson_tape_key(const sjson_tape *tape, size_t v, size_t *len) {
+    if (v == 0 || SJSON_TAPE_TYPE(tape->words[v - 1]) != 'k')
+        return NULL;
+    return sjson_tape_str(tape, v - 1, len);
+}
+
+SjsonResult sjson_tape_object_get(const sjson_tape *tape, size_t v,
+                                  const char *key, size_t *child) {
+    size_t len = strlen(key), keylen = 0;
+    if (SJSON_TAPE_TYPE(tape->words[v]) != '{')
         return SJSON_ERR_WRONG_TYPE;
+    sjson_tape_foreach(tape, v, it) {
+        const char *k = sjson_tape_key(tape, it, &keylen);
+        if (k != NULL && keylen == len && memcmp(k, key, len) == 0) {
+            *child = it;
+            return SJSON_SUCCESS;
+        }
     }
-    if (lexer->end - lexer->start + 1 < len) {
-        return SJSON_ERR_INVALID_SOURCE;
+    return SJSON_ERR_NO_MATCHING_MEMBER;
+}
+
+SjsonResult sjson_tape_array_get(const sjson_tape *tape, size_t v, size_t i,
+                                 size_t *child) {
+    if (SJSON_TAPE_TYPE(tape->words[v]) != '[')
+        return SJSON_ERR_WRONG_TYPE;
+    sjson_tape_foreach(tape, v, it) {
+        if (i-- == 0) {
+            *child = it;
+            return SJSON_SUCCESS;
+        }
     }
-    sjsonlexer_pushtok(lexer, type, lexer->c, lexer->c + len - 1);
-    lexer->c += len - 1;
+    return SJSON_ERR_NO_MATCHING_MEMBER;
+}
 
-    return SJSON_SUCCESS;
+/*
+ * shortest round-trip double to string, Grisu2 after Florian Loitsch,
+ * "Printing Floating-Point Numbers Quickly and Accurately with Integers"
+ * digits always parse back to the same double, and are the shortest
+ * such digits in all but a tiny fraction of inputs
+ */
+typedef struct sjsondiyfp {
+    uint64_t f;
+    int e;
+} sjsondiyfp;
+
+/* 10^k for k = -348, -340, ..., 340 as normalized 64 bit diyfp */
+static const uint64_t sjson_cachedpow_f[] = {
+    0xfa8fd5a0081c0288ull, 0xbaaee17fa23ebf76ull, 0x8b16fb203055ac76ull,
+    0xcf42894a5dce35eaull, 0x9a6bb0aa55653b2dull, 0xe61acf033d1a45dfull,
+    0xab70fe17c79ac6caull, 0xff77b1fcbebcdc4full, 0xbe5691ef416bd60cull,
+    0x8dd01fad907ffc3cull, 0xd3515c2831559a83ull, 0x9d71ac8fada6c9b5ull,
+    0xea9c227723ee8bcbull, 0xaecc49914078536dull, 0x823c12795db6ce57ull,
+    0xc21094364dfb5637ull, 0x9096ea6f3848984full, 0xd77485cb25823ac7ull,
+    0xa086cfcd97bf97f4ull, 0xef340a98172aace5ull, 0xb23867fb2a35b28eull,
+    0x84c8d4dfd2c63f3bull, 0xc5dd44271ad3cdbaull, 0x936b9fcebb25c996ull,
+    0xdbac6c247d62a584ull, 0xa3ab66580d5fdaf6ull, 0xf3e2f893dec3f126ull,
+    0xb5b5ada8aaff80b8ull, 0x87625f056c7c4a8bull, 0xc9bcff6034c13053ull,
+    0x964e858c91ba2655ull, 0xdff9772470297ebdull, 0xa6dfbd9fb8e5b88full,
+    0xf8a95fcf88747d94ull, 0xb94470938fa89bcfull, 0x8a08f0f8bf0f156bull,
+    0xcdb02555653131b6ull, 0x993fe2c6d07b7facull, 0xe45c10c42a2b3b06ull,
+    0xaa242499697392d3ull, 0xfd87b5f28300ca0eull, 0xbce5086492111aebull,
+    0x8cbccc096f5088ccull, 0xd1b71758e219652cull, 0x9c40000000000000ull,
+    0xe8d4a51000000000ull, 0xad78ebc5ac620000ull, 0x813f3978f8940984ull,
+    0xc097ce7bc90715b3ull, 0x8f7e32ce7bea5c70ull, 0xd5d238a4abe98068ull,
+    0x9f4f2726179a2245ull, 0xed63a231d4c4fb27ull, 0xb0de65388cc8ada8ull,
+    0x83c7088e1aab65dbull, 0xc45d1df942711d9aull, 0x924d692ca61be758ull,
+    0xda01ee641a708deaull, 0xa26da3999aef774aull, 0xf209787bb47d6b85ull,
+    0xb454e4a179dd1877ull, 0x865b86925b9bc5c2ull, 0xc83553c5c8965d3dull,
+    0x952ab45cfa97a0b3ull, 0xde469fbd99a05fe3ull, 0xa59bc234db398c25ull,
+    0xf6c69a72a3989f5cull, 0xb7dcbf5354e9beceull, 0x88fcf317f22241e2ull,
+    0xcc20ce9bd35c78a5ull, 0x98165af37b2153dfull, 0xe2a0b5dc971f303aull,
+    0xa8d9d1535ce3b396ull, 0xfb9b7cd9a4a7443cull, 0xbb764c4ca7a44410ull,
+    0x8bab8eefb6409c1aull, 0xd01fef10a657842cull, 0x9b10a4e5e9913129ull,
+    0xe7109bfba19c0c9dull, 0xac2820d9623bf429ull, 0x80444b5e7aa7cf85ull,
+    0xbf21e44003acdd2dull, 0x8e679c2f5e44ff8full, 0xd433179d9c8cb841ull,
+    0x9e19db92b4e31ba9ull, 0xeb96bf6ebadf77d9ull, 0xaf87023b9bf0ee6bull,
+};
+
+static const int16_t sjson_cachedpow_e[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980, -954,
+    -927, -901, -874, -847, -821, -794, -768, -741, -715, -688, -661, -635,
+    -608, -582, -555, -529, -502, -475, -449, -422, -396, -369, -343, -316,
+    -289, -263, -236, -210, -183, -157, -130, -103, -77, -50, -24, 3, 30, 56,
+    83, 109, 136, 162, 189, 216, 242, 269, 295, 322, 348, 375, 402, 428, 455,
+    481, 508, 534, 561, 588, 614, 641, 667, 694, 720, 747, 774, 800, 827, 853,
+    880, 907, 933, 960, 986, 1013, 1039, 1066,
+};
+
+static sjsondiyfp sjson_diyfp_mul(sjsondiyfp x, sjsondiyfp y) {
+    const uint64_t m32 = 0xFFFFFFFFu;
+    uint64_t a = x.f >> 32, b = x.f & m32, c = y.f >> 32, d = y.f & m32;
+    uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+    uint64_t tmp = (bd >> 32) + (ad & m32) + (bc & m32);
+    tmp += 1u << 31; /* round */
+    return (sjsondiyfp){ac + (ad >> 32) + (bc >> 32) + (tmp >> 32),
+                        x.e + y.e + 64};
 }
 
-SjsonResult sjsonlexer_lex(sjsonlexer *lexer) {
-    while (!sjsonlexer_isend(lexer)) {
-        SjsonResult ret;
-        switch (sjsonlexer_peek(lexer)) {
-        case '[':
-            sjsonlexer_pushtok(lexer, SJSON_TKLSQUAREBRACKET, lexer->c,
-                               lexer->c);
-            break;
-        case ']':
-            sjsonlexer_pushtok(lexer, SJSON_TKRSQUAREBRACKET, lexer->c,
-                               lexer->c);
+static void sjson_grisuround(char *buf, int len, uint64_t delta, uint64_t rest,
+                             uint64_t tenkappa, uint64_t wpw) {
+    while (rest < wpw && delta - rest >= tenkappa &&
+           (rest + tenkappa < wpw || wpw - rest > rest + tenkappa - wpw)) {
+        buf[len - 1]--;
+        rest += tenkappa;
+    }
+}
+
+/* digits of v to buf, v = digits * 10^*k */
+static int sjson_grisu2(double v, char *buf, int *k) {
+    static const uint64_t pow10[] = {
+        1ull,
+        10ull,
+        100ull,
+        1000ull,
+        10000ull,
+        100000ull,
+        1000000ull,
+        10000000ull,
+        100000000ull,
+        1000000000ull,
+        10000000000ull,
+        100000000000ull,
+        1000000000000ull,
+        10000000000000ull,
+        100000000000000ull,
+        1000000000000000ull,
+        10000000000000000ull,
+        100000000000000000ull,
+        1000000000000000000ull,
+        10000000000000000000ull,
+    };
+    const uint64_t hidden = 0x0010000000000000ull;
+    uint64_t u;
+    sjsondiyfp w, mp, mm, c;
+    int len = 0;
+
+    memcpy(&u, &v, sizeof u);
+    {
+        int biased = (int)((u >> 52) & 0x7FF);
+        uint64_t significand = u & (hidden - 1);
+        if (biased)
+            w = (sjsondiyfp){significand + hidden, biased - 1075};
+        else
+            w = (sjsondiyfp){significand, -1074};
+    }
+
+    /* boundaries m+ and m-, m+ normalized, m- at the same exponent */
+    mp = (sjsondiyfp){(w.f << 1) + 1, w.e - 1};
+    while (!(mp.f & (hidden << 1)))
+        mp.f <<= 1, mp.e--;
+    mp.f <<= 10, mp.e -= 10;
+    if (w.f == hidden)
+        mm = (sjsondiyfp){(w.f << 2) - 1, w.e - 2};
+    else
+        mm = (sjsondiyfp){(w.f << 1) - 1, w.e - 1};
+    mm.f <<= mm.e - mp.e;
+    mm.e = mp.e;
+
+    while (!(w.f & hidden))
+        w.f <<= 1, w.e--;
+    w.f <<= 11, w.e -= 11;
+
+    /* cached power bringing m+ exponent into [-60, -32] */
+    {
+        double dk = (-61 - mp.e) * 0.30102999566398114 + 347;
+        int ik = (int)dk;
+        if (dk - ik > 0.0)
+            ik++;
+        unsigned index = (unsigned)((ik >> 3) + 1);
+        *k = -(-348 + (int)(index << 3));
+        c = (sjsondiyfp){sjson_cachedpow_f[index], sjson_cachedpow_e[index]};
+    }
+    w = sjson_diyfp_mul(w, c);
+    mp = sjson_diyfp_mul(mp, c);
+    mm = sjson_diyfp_mul(mm, c);
+    mm.f++;
+    mp.f--;
+
+    /* digit generation */
+    {
+        uint64_t delta = mp.f - mm.f, wpw = mp.f - w.f;
+        int shift = -mp.e, kappa = 0;
+        uint64_t one = 1ull << shift;
+        uint32_t p1 = (uint32_t)(mp.f >> shift);
+        uint64_t p2 = mp.f & (one - 1);
+
+        for (uint32_t t = p1; t; t /= 10)
+            kappa++;
+        while (kappa > 0) {
+            uint32_t div = (uint32_t)pow10[kappa - 1], d = p1 / div;
+            p1 %= div;
+            if (d || len)
+                buf[len++] = (char)('0' + d);
+            kappa--;
+            uint64_t rest = ((uint64_t)p1 << shift) + p2;
+            if (rest <= delta) {
+                *k += kappa;
+                sjson_grisuround(buf, len, delta, rest, pow10[kappa] << shift,
+                                 wpw);
+                return len;
+            }
+        }
+        for (;;) {
+            p2 *= 10;
+            delta *= 10;
+            char d = (char)(p2 >> shift);
+            if (d || len)
+                buf[len++] = (char)('0' + d);
+            p2 &= one - 1;
+            kappa--;
+            if (p2 < delta) {
+                *k += kappa;
+                sjson_grisuround(buf, len, delta, p2, one,
+                                 -kappa < 20 ? wpw * pow10[-kappa] : 0);
+                return len;
+            }
+        }
+    }
+}
+
+static size_t sjson_utoa(uint64_t u, char *buf) {
+    char tmp[20];
+    size_t len = 0, n = 0;
+    do
+        tmp[n++] = (char)('0' + u % 10);
+    while (u /= 10);
+    while (n)
+        buf[len++] = tmp[--n];
+    return len;
+}
+
+static size_t sjson_itoa(int64_t i, char *buf) {
+    if (i < 0) {
+        buf[0] = '-';
+        return 1 + sjson_utoa(0 - (uint64_t)i, buf + 1);
+    }
+    return sjson_utoa((uint64_t)i, buf);
+}
+
+/**
+ * format v into buf (at least 32 bytes), shortest form that parses back
+ * to exactly v, whole numbers below 2^53 go through integer formatting,
+ * nan and infinity have no json form and become null
+ */
+static size_t sjson_dtoa(double v, char *buf) {
+    char *p = buf;
+    int len, k, kk;
+
+    if (v != v || v - v != 0) {
+        memcpy(buf, "null", 4);
+        return 4;
+    }
+    if (v == 0) {
+        if (signbit(v))
+            *p++ = '-';
+        *p++ = '0';
+        return p - buf;
+    }
+    if (v > -9007199254740992.0 && v < 9007199254740992.0 && v == (int64_t)v)
+        return sjson_itoa((int64_t)v, buf);
+    if (v < 0) {
+        *p++ = '-';
+        v = -v;
+    }
+
+    len = sjson_grisu2(v, p, &k);
+    kk = len + k; /* 10^(kk-1) <= v < 10^kk */
+    if (len <= kk && kk <= 21) {
+        /* 1234e7 -> 12340000000 */
+        memset(p + len, '0', kk - len);
+        p += kk;
+    } else if (0 < kk && kk <= 21) {
+        /* 1234e-2 -> 12.34 */
+        memmove(p + kk + 1, p + kk, len - kk);
+        p[kk] = '.';
+        p += len + 1;
+    } else if (-6 < kk && kk <= 0) {
+        /* 1234e-6 -> 0.001234 */
+        int offset = 2 - kk;
+        memmove(p + offset, p, len);
+        p[0] = '0';
+        p[1] = '.';
+        memset(p + 2, '0', offset - 2);
+        p += len + offset;
+    } else {
+        /* 1234e30 -> 1.234e33 */
+        if (len > 1) {
+            memmove(p + 2, p + 1, len - 1);
+            p[1] = '.';
+            p += len + 1;
+        } else {
+            p++;
+        }
+        *p++ = 'e';
+        if (kk - 1 < 0) {
+            *p++ = '-';
+            p += sjson_utoa((uint64_t)(1 - kk), p);
+        } else {
+            p += sjson_utoa((uint64_t)(kk - 1), p);
+        }
+    }
+    return p - buf;
+}
+
+/* serializer output, appends to buf or flushes chunks through write */
+typedef struct sjsonsink {
+    sjsonbuf *buf;
+    sjson_writefn write;
+    void *ctx;
+    char *chunk;
+    size_t len;
+    SjsonResult err; /* first error, output is dropped after it */
+} sjsonsink;
+
+static void sjsonsink_flush(sjsonsink *sink) {
+    if (sink->len && !sink->err &&
+        sink->write(sink->ctx, sink->chunk, sink->len))
+        sink->err = SJSON_ERR_WRITE;
+    sink->len = 0;
+}
+
+static void sjsonsink_push(sjsonsink *sink, const void *s, size_t len) {
+    if (sink->err)
+        return;
+    if (sink->buf) {
+        sink->err = sjsonbuf_push(sink->buf, s, len);
+        return;
+    }
+    if (SJSON_WRITE_CHUNK - sink->len < len) {
+        sjsonsink_flush(sink);
+        if (len >= SJSON_WRITE_CHUNK) {
+            if (!sink->err && sink->write(sink->ctx, (const char *)s, len))
+                sink->err = SJSON_ERR_WRITE;
+            return;
+        }
+    }
+    memcpy(sink->chunk + sink->len, s, len);
+    sink->len += len;
+}
+
+/* first byte of [p, end) that must be escaped, with ascii any >= 0x80 */
+static const char *sjson_scanescape(const char *p, const char *end,
+                                    bool ascii) {
+#ifdef SJSON_VW
+    for (; end - p >= SJSON_VW; p += SJSON_VW) {
+        sjsonvec v = sjsonvec_load(p);
+        uint32_t m = sjsonvec_mask(sjsonvec_or(
+            sjsonvec_or(sjsonvec_eq(v, '"'), sjsonvec_eq(v, '\\')),
+            sjsonvec_le(v, 0x1f)));
+        if (ascii)
+            m |= sjsonvec_mask(v);
+        if (m)
+            return p + sjson_ctz(m);
+    }
+#endif
+    for (; p < end; p++) {
+        unsigned char c = (unsigned char)*p;
+        if (c == '"' || c == '\\' || c < 0x20 || (ascii && c >= 0x80))
             break;
-        case '{':
-            sjsonlexer_pushtok(lexer, SJSON_TKLBRACE, lexer->c, lexer->c);
+    }
+    return p;
+}
+
+/* \uXXXX of one UTF-16 unit */
+static void sjsonsink_pushu(sjsonsink *sink, uint32_t unit) {
+    static const char hex[] = "0123456789abcdef";
+    char esc[6] = {'\\', 'u', hex[unit >> 12 & 0xf], hex[unit >> 8 & 0xf],
+                   hex[unit >> 4 & 0xf], hex[unit & 0xf]};
+    sjsonsink_push(sink, esc, sizeof(esc));
+}
+
+/* escaped string body, runs needing no escape are pushed in one go,
+ * control characters become \uXXXX unless they have a short escape,
+ * with ascii so do non-ASCII characters, as surrogate pairs above BMP */
+static void sjsonsink_pushesc(sjsonsink *sink, const char *s, size_t len,
+                              bool ascii) {
+    const char *end = s + len;
+    while (s < end) {
+        const char *run = s;
+        const char *esc = NULL;
+        s = sjson_scanescape(s, end, ascii);
+        sjsonsink_push(sink, run, s - run);
+        if (s >= end)
             break;
-        case '}':
-            sjsonlexer_pushtok(lexer, SJSON_TKRBRACE, lexer->c, lexer->c);
+        switch (*s) {
+        case '\"':
+            esc = "\\\"";
             break;
-        case ',':
-            sjsonlexer_pushtok(lexer, SJSON_TKCOMMA, lexer->c, lexer->c);
+        case '\\':
+            esc = "\\\\";
             break;
-        case ':':
-            sjsonlexer_pushtok(lexer, SJSON_TKCOLON, lexer->c, lexer->c);
+        case '\b':
+            esc = "\\b";
             break;
-        case '0':
-        case '1':
-        case '2':
-        case '3':
-        case '4':
-        case '5':
-        case '6':
-        case '7':
-        case '8':
-        case '9':
-        case '+':
-        case '-':
-            if ((ret = sjsonlexer_lexnumber(lexer))) {
-                return ret;
-            }
+        case '\f':
+            esc = "\\f";
             break;
-        case '\"':
-            if ((ret = sjsonlexer_lexstring(lexer))) {
-                return ret;
-            }
+        case '\n':
+            esc = "\\n";
             break;
-        case 'n':
-        case 't':
-        case 'f':
-            if ((ret = sjsonlexer_lexprimitive(lexer))) {
-                return ret;
-            }
+        case '\r':
+            esc = "\\r";
             break;
-        case ' ':
         case '\t':
-        case '\n':
+            esc = "\\t";
+            break;
+        }
+        if (esc != NULL) {
+            sjsonsink_push(sink, esc, 2);
+            s++;
+        } else if ((unsigned char)*s < 0x80) {
+            sjsonsink_pushu(sink, (unsigned char)*s);
+            s++;
+        } else {
+            uint32_t cp;
+            s += sjson_utf8_decode((const unsigned char *)s,
+                                   (const unsigned char *)end, &cp);
+            if (cp >= 0x10000) {
+                cp -= 0x10000;
+                sjsonsink_pushu(sink, 0xd800 + (cp >> 10));
+                sjsonsink_pushu(sink, 0xdc00 + (cp & 0x3ff));
+            } else {
+                sjsonsink_pushu(sink, cp);
+            }
+        }
+    }
+}
+
+/* quoted and escaped string */
+static void sjsonsink_pushstr(sjsonsink *sink, const char *s, size_t len) {
+    sjsonsink_push(sink, "\"", 1);
+    sjsonsink_pushesc(sink, s, len, false);
+    sjsonsink_push(sink, "\"", 1);
+}
+
+SjsonResult sjson_escape(const char *s, size_t len, int flags,
+                         sjsonbuf *out) {
+    sjsonsink sink = {.buf = out};
+    sjsonsink_pushesc(&sink, s, len, flags & SJSON_ESCAPE_ASCII);
+    return sink.err;
+}
+
+SjsonResult sjson_unescape(const char *s, size_t len, sjsonbuf *out) {
+    size_t n;
+    SjsonResult ret;
+    if (sjsonbuf_reserve(out, len))
+        return SJSON_ERR_NO_MEMORY;
+    if ((ret = sjson_decode(s, s + len, out->buf + out->len, &n)))
+        return ret;
+    out->len += n;
+    out->buf[out->len] = '\x0';
+    return SJSON_SUCCESS;
+}
+
+/* one value, containers only get their opening bracket, or both if
+ * empty, returns whether children follow */
+static bool sjson_emitvalue(sjsonsink *sink, sjson *json) {
+    /* never expanded, so unchanged, its source is its serialization */
+    if (json->flags & SJSON_FLAG_LAZY) {
+        sjsonsink_push(sink, json->v.str, json->x.len);
+        return false;
+    }
+    switch (json->type) {
+    case SJSON_NUMBER: {
+        char buf[32];
+        size_t len;
+        /* x.i is stale if v.num was assigned after parsing */
+        if ((json->flags & SJSON_FLAG_INT) && (double)json->x.i == json->v.num)
+            len = sjson_itoa(json->x.i, buf);
+        else
+            len = sjson_dtoa(json->v.num, buf);
+        sjsonsink_push(sink, buf, len);
+        break;
+    }
+    case SJSON_STRING:
+        sjsonsink_pushstr(sink, json->v.str, sjson_strlen(json));
+        break;
+    case SJSON_NULL:
+        sjsonsink_push(sink, "null", 4);
+        break;
+    case SJSON_TRUE:
+        sjsonsink_push(sink, "true", 4);
+        break;
+    case SJSON_FALSE:
+        sjsonsink_push(sink, "false", 5);
+        break;
+    case SJSON_OBJECT:
+        if (json->v.child == NULL) {
+            sjsonsink_push(sink, "{}", 2);
             break;
-        default:
+        }
+        sjsonsink_push(sink, "{", 1);
+        return true;
+    case SJSON_ARRAY:
+        if (json->v.child == NULL) {
+            sjsonsink_push(sink, "[]", 2);
             break;
         }
-        sjsonlexer_advance(lexer);
+        sjsonsink_push(sink, "[", 1);
+        return true;
+    case SJSON_INVALID:
+    default:
+        break;
     }
-    return SJSON_SUCCESS;
+    return false;
 }
 
-sjson_result sjson_new(int type) {
-    sjson *json = (sjson *)calloc(1, sizeof(*json));
-    if (json == NULL) {
-        return (sjson_result){
-            .err = SJSON_ERR_NO_MEMORY,
-        };
+/* depth first, containers whose children are being written are kept on
+ * an explicit stack, not the call stack */
+static void sjson_emit(sjsonsink *sink, sjson *json) {
+    sjson *local[32], **stack = local;
+    size_t depth = 0, cap = sizeof(local) / sizeof(*local);
+
+    for (;;) {
+        if (depth > 0 && stack[depth - 1]->type == SJSON_OBJECT) {
+            sjsonsink_pushstr(sink, json->key, sjson_keylen(json));
+            sjsonsink_push(sink, ":", 1);
+        }
+        if (sjson_emitvalue(sink, json)) {
+            if (depth == cap) {
+                sjson **grown = (sjson **)sjson_stackgrow(
+                    stack, &cap, sizeof(*stack), local);
+                if (grown == NULL) {
+                    sink->err = SJSON_ERR_NO_MEMORY;
+                    break;
+                }
+                stack = grown;
+            }
+            stack[depth++] = json;
+            json = json->v.child;
+            continue;
+        }
+        /* close containers whose last child this was */
+        while (depth > 0 && json->next == NULL) {
+            json = stack[--depth];
+            sjsonsink_push(sink, json->type == SJSON_OBJECT ? "}" : "]", 1);
+        }
+        if (depth == 0 || sink->err)
+            break;
+        sjsonsink_push(sink, ",", 1);
+        json = json->next;
     }
-    json->type = type;
-    return (sjson_result){.json = json};
+    if (stack != local)
+        free(stack);
 }
 
-void sjson_free(sjson *json) {
-    if (json->type == SJSON_OBJECT || json->type == SJSON_ARRAY)
-        if (json->v.child != NULL)
-            sjson_free(json->v.child);
-    if (json->next != NULL)
-        sjson_free(json->next);
-    free(json);
-}
+/* container of sjson_emitcached whose children are being written */
+struct sjsoncacheframe {
+    sjson *json;
+    const char *old; /* its bytes in previous output, NULL if unknown */
+    size_t start;    /* its offset in output */
+};
 
-static sjson_result sjson_parseobject(sjsontokarr *toks) {
-    sjson_result obj = sjson_new(SJSON_OBJECT);
-    if (obj.err) {
-        return (sjson_result){.err = obj.err};
+/* remember where container json was written, in its index. arena
+ * containers that the parser left without one are written in full */
+static void sjson_cacheat(sjson *json, size_t rel, size_t len) {
+    sjsonindex *index = json->index;
+    if (index == NULL && !(json->flags & SJSON_FLAG_ARENA))
+        index = json->index = (sjsonindex *)calloc(1, sizeof(*index));
+    if (index == NULL) {
+        json->flags &= ~(SJSON_FLAG_CACHED | SJSON_FLAG_DIRTY);
+        return;
     }
+    index->cacheat = rel;
+    index->cachelen = len;
+    json->flags = (json->flags | SJSON_FLAG_CACHED) & ~SJSON_FLAG_DIRTY;
+}
 
-    if (sjsontokarr_advance(toks).type != SJSON_TKLBRACE) {
-        return (sjson_result){.err = SJSON_ERR_INVALID_SOURCE};
-    }
+/* like sjson_emit into a buffer, clean cached containers are copied from
+ * old, the previous output, every container written records its place */
+static void sjson_emitcached(sjsonsink *sink, sjson *json, const char *old) {
+    struct sjsoncacheframe local[32], *stack = local;
+    size_t depth = 0, cap = sizeof(local) / sizeof(*local);
+    sjsonbuf *buf = sink->buf;
 
-    while (sjsontokarr_peek(toks).type != SJSON_TKRBRACE) {
-        const char *key = sjsontokarr_advance(toks).start;
-        sjson_result child;
-        if (sjsontokarr_advance(toks).type != SJSON_TKCOLON) {
-            return (sjson_result){.err = SJSON_ERR_NO_TERMINATING_BRACE};
-        }
-        child = sjson_parse(toks);
-        if (child.err) {
-            return child;
+    for (;;) {
+        struct sjsoncacheframe *top = depth ? &stack[depth - 1] : NULL;
+        /* the root is at offset 0 of old */
+        const char *base = top ? top->old : old;
+        size_t parentstart = top ? top->start : 0;
+        bool container =
+            (json->type == SJSON_OBJECT || json->type == SJSON_ARRAY) &&
+            !(json->flags & SJSON_FLAG_LAZY);
+        bool cached = base != NULL && container &&
+                      (json->flags & SJSON_FLAG_CACHED);
+        size_t at;
+
+        if (top && top->json->type == SJSON_OBJECT) {
+            sjsonsink_pushstr(sink, json->key, sjson_keylen(json));
+            sjsonsink_push(sink, ":", 1);
         }
-        child.json->key = key;
-        SjsonResult ret = sjson_addchild(obj.json, child.json);
-        if (ret != SJSON_SUCCESS) {
-            return (sjson_result){.err = ret};
+        at = buf->len;
+        if (cached && !(json->flags & SJSON_FLAG_DIRTY)) {
+            sjsonsink_push(sink, base + json->index->cacheat,
+                           json->index->cachelen);
+        } else if (sjson_emitvalue(sink, json)) {
+            if (depth == cap) {
+                struct sjsoncacheframe *grown = (struct sjsoncacheframe *)
+                    sjson_stackgrow(stack, &cap, sizeof(*stack), local);
+                if (grown == NULL) {
+                    sink->err = SJSON_ERR_NO_MEMORY;
+                    break;
+                }
+                stack = grown;
+            }
+            stack[depth++] = (struct sjsoncacheframe){
+                json, cached ? base + json->index->cacheat : NULL, at};
+            json = json->v.child;
+            continue;
         }
-        sjsontok next = sjsontokarr_peek(toks);
-        if (next.type == SJSON_TKCOMMA) {
-            sjsontokarr_advance(toks);
-        } else if (next.type != SJSON_TKRBRACE) {
-            return (sjson_result){
-                .err = SJSON_ERR_NO_TERMINATING_BRACE,
-            };
+        if (container)
+            sjson_cacheat(json, at - parentstart, buf->len - at);
+
+        /* close containers whose last child this was */
+        while (depth > 0 && json->next == NULL) {
+            struct sjsoncacheframe *frame = &stack[--depth];
+            json = frame->json;
+            sjsonsink_push(sink, json->type == SJSON_OBJECT ? "}" : "]", 1);
+            sjson_cacheat(json,
+                          frame->start - (depth ? stack[depth - 1].start : 0),
+                          buf->len - frame->start);
         }
+        if (depth == 0 || sink->err)
+            break;
+        sjsonsink_push(sink, ",", 1);
+        json = json->next;
     }
-    return obj;
+    if (stack != local)
+        free(stack);
 }
 
-static sjson_result sjson_parsearray(sjsontokarr *toks) {
-    sjson_result arr = sjson_new(SJSON_ARRAY);
-    if (arr.err)
-        return (sjson_result){.err = arr.err};
+SjsonResult sjson_serialize_cached(sjson *json, sjsonbuf *buf) {
+    sjsonbuf out = {0};
+    const char *old = NULL;
+    if (json->parent == NULL && (json->flags & SJSON_FLAG_CACHED) &&
+        buf->buf != NULL && json->index->cachelen == buf->len) {
+        if (!(json->flags & SJSON_FLAG_DIRTY))
+            return SJSON_SUCCESS;
+        old = buf->buf;
+    }
+    sjsonsink sink = {.buf = &out};
+    if (sjsonbuf_reserve(&out, buf->len))
+        sink.err = SJSON_ERR_NO_MEMORY;
+    else if (json->parent == NULL)
+        sjson_emitcached(&sink, json, old);
+    else
+        sjson_emit(&sink, json);
+    if (sink.err) {
+        /* offsets may be half updated, start over next time */
+        json->flags &= ~(SJSON_FLAG_CACHED | SJSON_FLAG_DIRTY);
+        free(out.buf);
+        return sink.err;
+    }
+    free(buf->buf);
+    *buf = out;
+    return SJSON_SUCCESS;
+}
 
-    if (sjsontokarr_advance(toks).type != SJSON_TKLSQUAREBRACKET)
-        return (sjson_result){.err = SJSON_ERR_INVALID_SOURCE};
+SjsonResult sjson_serialize_into(sjson *json, sjsonbuf *buf) {
+    sjsonsink sink = {.buf = buf};
+    sjson_emit(&sink, json);
+    return sink.err;
+}
 
-    while (sjsontokarr_peek(toks).type != SJSON_TKRSQUAREBRACKET) {
-        sjson_result child = sjson_parse(toks);
-        if (child.err)
-            return child;
-        else
-            sjson_addchild(arr.json, child.json);
-        sjsontok next = sjsontokarr_peek(toks);
-        if (next.type == SJSON_TKCOMMA)
-            sjsontokarr_advance(toks);
-        else if (next.type != SJSON_TKRSQUAREBRACKET)
-            return (sjson_result){
-                .err = SJSON_ERR_NO_TERMINATING_BRACKET,
-            };
-    }
-    return arr;
+SjsonResult sjson_serialize_to(sjson *json, sjson_writefn write, void *ctx) {
+    char chunk[SJSON_WRITE_CHUNK];
+    sjsonsink sink = {.write = write, .ctx = ctx, .chunk = chunk};
+    sjson_emit(&sink, json);
+    sjsonsink_flush(&sink);
+    return sink.err;
 }
 
-sjson_result sjson_parse(sjsontokarr *toks) {
-    sjson_result ret;
-    switch (sjsontokarr_peek(toks).type) {
-    case SJSON_TKTRUE:
-        ret = sjson_new(SJSON_TRUE);
-        break;
-    case SJSON_TKFALSE:
-        ret = sjson_new(SJSON_FALSE);
-        break;
-    case SJSON_TKNULL:
-        ret = sjson_new(SJSON_NULL);
-        break;
-    case SJSON_TKLBRACE:
-        ret = sjson_parseobject(toks);
-        if (ret.err)
-            return ret;
-        break;
-    case SJSON_TKLSQUAREBRACKET:
-        ret = sjson_parsearray(toks);
-        if (ret.err)
-            return ret;
-        break;
-    case SJSON_TKNUMBERLITERAL:
-        ret = sjson_new(SJSON_NUMBER);
-        if (ret.err)
-            return ret;
-        /* TODOOOOOO: stop using strtod as it only support base 10 and base 16,
-            ideally this should support 0o (octal) and 0b (binary) too */
-        ret.json->v.num = strtod(sjsontokarr_peek(toks).start, NULL);
-        break;
-    case SJSON_TKSTRINGLITERAL:
-        ret = sjson_new(SJSON_STRING);
-        if (ret.err)
-            return ret;
-        ret.json->v.str = sjsontokarr_peek(toks).start;
-        break;
-    default:
-        return (sjson_result){
-            .err = SJSON_ERR_UNKNOWN_TOKEN,
-        };
-    }
-    sjsontokarr_advance(toks);
-    return ret;
+int sjson_write_file(void *fp, const char *data, size_t len) {
+    return fwrite(data, 1, len, (FILE *)fp) != len;
 }
 
-SjsonResult sjson_replace(sjson *parent, sjson *oldsibling,
-                              sjson *newsibling) {
-    if (!oldsibling || !newsibling)
-        return SJSON_ERR_NULL_REFERENCE;
-    if (parent) {
-        if (parent->v.tail == oldsibling)
-            parent->v.tail == newsibling;
-        if (parent->v.child == oldsibling)
-            parent->v.child = newsibling;
+#ifdef SJSON_HAVE_FD
+int sjson_write_fd(void *fd, const char *data, size_t len) {
+    while (len) {
+        ssize_t n = write(*(int *)fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 1;
+        data += n, len -= n;
     }
-    if (oldsibling->prev)
-        oldsibling->prev->next = newsibling;
-    if (oldsibling->next)
-        oldsibling->next->prev = newsibling;
-    sjson_free(oldsibling);
-    return SJSON_SUCCESS;
+    return 0;
 }
+#endif /* SJSON_HAVE_FD */
 
-SjsonResult sjson_deletechild(sjson *json, sjson *child) {
-    if (json->v.child == NULL)
-        return SJSON_ERR_NO_MATCHING_MEMBER;
-    if (json->v.tail == child) {
-        if (json->v.child == child)
-            json->v.tail = json->v.child = NULL;
-        else
-            json->v.tail = child->prev;
-    } else if (json->v.child == child) {
-        json->v.child = child->next;
-    }
-    if (child->prev)
-        child->prev->next = child->next;
-    if (child->next)
-        child->next->prev = child->prev;
-    return SJSON_SUCCESS;
+sjsonbuf sjson_serialize(sjson *json) {
+    sjsonbuf s;
+    sjsonbuf_init(&s);
+    sjson_serialize_into(json, &s);
+    return s;
 }
 
-sjson_result sjson_object_get(sjson *json, char *key) {
-    if (json->type != SJSON_OBJECT)
-        return (sjson_result){.err = SJSON_ERR_WRONG_TYPE};
-    sjson_foreach(json, iter) if (!strcmp(iter->key, key)) return (
-        sjson_result){.json = iter};
-    return (sjson_result){
-        .err = SJSON_ERR_NO_MATCHING_MEMBER,
-    };
+/* '{' or '[' for the innermost open container, 0 at top level */
+static char sjson_writer_top(const sjson_writer *w) {
+    return w->depth ? w->stack[w->depth - 1] : 0;
 }
 
-SjsonResult sjson_object_delete_all(sjson *json, char *key) {
-    if (json->type != SJSON_OBJECT)
-        return SJSON_ERR_WRONG_TYPE;
-    sjson_foreach(json, iter) if (!strcmp(iter->key, key))
-        sjson_deletechild(json, iter);
-    return SJSON_SUCCESS;
+/* record err unless w already failed */
+static SjsonResult sjson_writer_fail(sjson_writer *w, SjsonResult err) {
+    if (!w->err)
+        w->err = err;
+    return w->err;
 }
 
-SjsonResult sjson_object_set(sjson *json, char *key, sjson *value) {
-    if (json->type != SJSON_OBJECT)
-        return SJSON_ERR_WRONG_TYPE;
-    sjson_object_delete_all(json, key);
-    value->key = key;
-    sjson_addchild(json, value);
-    return SJSON_SUCCESS;
+/* comma before a value, if due */
+static SjsonResult sjson_writer_prefix(sjson_writer *w) {
+    /* in objects keys come first, only one value at top level */
+    if ((!w->key && sjson_writer_top(w) == '{') || (!w->depth && w->comma))
+        return sjson_writer_fail(w, SJSON_ERR_WRONG_TYPE);
+    if (w->comma && !w->key && !w->err)
+        w->err = sjsonbuf_push(&w->buf, ",", 1);
+    w->key = false;
+    return w->err;
 }
 
-SjsonResult sjson_addchild(sjson *json, sjson *child) {
-    if (json->type != SJSON_OBJECT && json->type != SJSON_ARRAY)
-        return SJSON_ERR_WRONG_TYPE;
-    if (json->v.tail == NULL && json->v.child == NULL) {
-        json->v.tail = json->v.child = child;
-    } else {
-        json->v.tail->next = child;
-        child->prev = json->v.tail;
-        json->v.tail = child;
+static SjsonResult sjson_writer_push(sjson_writer *w, const char *s,
+                                     size_t len) {
+    if (!w->err)
+        w->err = sjsonbuf_push(&w->buf, s, len);
+    w->comma = true;
+    return w->err;
+}
+
+static SjsonResult sjson_writer_begin(sjson_writer *w, bool object) {
+    if (sjson_writer_prefix(w))
+        return w->err;
+    if (w->depth == w->stackcap) {
+        size_t cap = w->stackcap ? w->stackcap * 2 : 32;
+        char *stack = (char *)realloc(w->stack, cap);
+        if (stack == NULL)
+            return sjson_writer_fail(w, SJSON_ERR_NO_MEMORY);
+        w->stack = stack;
+        w->stackcap = cap;
     }
-    return SJSON_SUCCESS;
+    w->stack[w->depth++] = object ? '{' : '[';
+    sjson_writer_push(w, object ? "{" : "[", 1);
+    w->comma = false;
+    return w->err;
 }
 
-sjson_result sjson_array_get(sjson *json, size_t i) {
-    size_t x = 0;
-    sjson_foreach(json, iter) if (x++ == i) return (sjson_result){.json = iter};
-    return (sjson_result){
-        .err = SJSON_ERR_NO_MATCHING_MEMBER,
-    };
+static SjsonResult sjson_writer_end(sjson_writer *w, bool object) {
+    if (w->err)
+        return w->err;
+    if (sjson_writer_top(w) != (object ? '{' : '[') || w->key)
+        return sjson_writer_fail(w, SJSON_ERR_WRONG_TYPE);
+    w->depth--;
+    return sjson_writer_push(w, object ? "}" : "]", 1);
 }
 
-SjsonResult sjson_array_set(sjson *json, size_t i, sjson *x) {
-    sjson *it = json->v.child;
-    for (size_t j = 0; it; j++) {
-        if (j == i) {
-            sjson_replace(json, it, x);
-            return SJSON_SUCCESS;
-        }
-        it = it->next;
-    }
-    return SJSON_ERR_NO_MATCHING_MEMBER;
+SjsonResult sjson_writer_begin_object(sjson_writer *w) {
+    return sjson_writer_begin(w, true);
 }
 
-SjsonResult sjson_array_delete(sjson *json, size_t i) {
-    sjson *it = json->v.child;
-    for (size_t j = 0; it; j++) {
-        if (j == i) {
-            sjson_deletechild(json, it);
-            return SJSON_SUCCESS;
-        }
-        it = it->next;
+SjsonResult sjson_writer_end_object(sjson_writer *w) {
+    return sjson_writer_end(w, true);
+}
+
+SjsonResult sjson_writer_begin_array(sjson_writer *w) {
+    return sjson_writer_begin(w, false);
+}
+
+SjsonResult sjson_writer_end_array(sjson_writer *w) {
+    return sjson_writer_end(w, false);
+}
+
+SjsonResult sjson_writer_key(sjson_writer *w, const char *key, size_t len) {
+    sjsonsink sink = {.buf = &w->buf, .err = w->err};
+    if (sjson_writer_top(w) != '{' || w->key)
+        return sjson_writer_fail(w, SJSON_ERR_WRONG_TYPE);
+    if (w->comma)
+        sjsonsink_push(&sink, ",", 1);
+    sjsonsink_pushstr(&sink, key, len);
+    sjsonsink_push(&sink, ":", 1);
+    w->err = sink.err;
+    w->key = true;
+    w->comma = false;
+    return w->err;
+}
+
+SjsonResult sjson_writer_string(sjson_writer *w, const char *s, size_t len) {
+    sjsonsink sink = {.buf = &w->buf};
+    if (sjson_writer_prefix(w))
+        return w->err;
+    sjsonsink_pushstr(&sink, s, len);
+    w->err = sink.err;
+    w->comma = true;
+    return w->err;
+}
+
+SjsonResult sjson_writer_number(sjson_writer *w, double num) {
+    char buf[32];
+    if (sjson_writer_prefix(w))
+        return w->err;
+    return sjson_writer_push(w, buf, sjson_dtoa(num, buf));
+}
+
+SjsonResult sjson_writer_int(sjson_writer *w, int64_t i) {
+    char buf[32];
+    if (sjson_writer_prefix(w))
+        return w->err;
+    return sjson_writer_push(w, buf, sjson_itoa(i, buf));
+}
+
+SjsonResult sjson_writer_bool(sjson_writer *w, bool b) {
+    if (sjson_writer_prefix(w))
+        return w->err;
+    return b ? sjson_writer_push(w, "true", 4)
+             : sjson_writer_push(w, "false", 5);
+}
+
+SjsonResult sjson_writer_null(sjson_writer *w) {
+    if (sjson_writer_prefix(w))
+        return w->err;
+    return sjson_writer_push(w, "null", 4);
+}
+
+SjsonResult sjson_writer_json(sjson_writer *w, sjson *json) {
+    sjsonsink sink = {.buf = &w->buf};
+    if (sjson_writer_prefix(w))
+        return w->err;
+    sjson_emit(&sink, json);
+    w->err = sink.err;
+    w->comma = true;
+    return w->err;
+}
+
+void sjson_writer_reset(sjson_writer *w) {
+    sjsonbuf buf = w->buf;
+    buf.len = 0;
+    if (buf.buf != NULL)
+        buf.buf[0] = '\x0';
+    *w = (sjson_writer){.buf = buf, .stack = w->stack, .stackcap = w->stackcap};
+}
+
+void sjson_writer_free(sjson_writer *w) {
+    free(w->buf.buf);
+    free(w->stack);
+    *w = (sjson_writer){0};
+}
+
+/* MessagePack tag followed by the low n bytes of v, big-endian */
+static void sjson_mpput(sjsonsink *sink, uint8_t tag, uint64_t v, int n) {
+    unsigned char b[9];
+    b[0] = tag;
+    for (int i = 0; i < n; i++)
+        b[1 + i] = (unsigned char)(v >> 8 * (n - 1 - i));
+    sjsonsink_push(sink, b, 1 + n);
+}
+
+/* header of a str, array or map of len items, fix form holds up to
+ * fixmax, then 8 (if t8), 16 and 32 bit lengths, tagged t8, t16, t16 + 1 */
+static void sjson_mplen(sjsonsink *sink, size_t len, uint8_t fix,
+                        size_t fixmax, uint8_t t8, uint8_t t16) {
+    if (len <= fixmax)
+        sjson_mpput(sink, fix | (uint8_t)len, 0, 0);
+    else if (t8 && len <= 0xff)
+        sjson_mpput(sink, t8, len, 1);
+    else if (len <= 0xffff)
+        sjson_mpput(sink, t16, len, 2);
+    else if (len <= 0xffffffff)
+        sjson_mpput(sink, t16 + 1, len, 4);
+    else if (!sink->err)
+        sink->err = SJSON_ERR_WRONG_TYPE;
+}
+
+static void sjson_mpstr(sjsonsink *sink, const char *s, size_t len) {
+    sjson_mplen(sink, len, 0xa0, 31, 0xd9, 0xda);
+    sjsonsink_push(sink, s, len);
+}
+
+static void sjson_mpint(sjsonsink *sink, int64_t i) {
+    if (i >= 0) {
+        if (i < 0x80)
+            sjson_mpput(sink, (uint8_t)i, 0, 0);
+        else if (i <= 0xff)
+            sjson_mpput(sink, 0xcc, i, 1);
+        else if (i <= 0xffff)
+            sjson_mpput(sink, 0xcd, i, 2);
+        else if (i <= 0xffffffff)
+            sjson_mpput(sink, 0xce, i, 4);
+        else
+            sjson_mpput(sink, 0xcf, i, 8);
+    } else if (i >= -32) {
+        sjson_mpput(sink, (uint8_t)i, 0, 0);
+    } else if (i >= INT8_MIN) {
+        sjson_mpput(sink, 0xd0, (uint64_t)i, 1);
+    } else if (i >= INT16_MIN) {
+        sjson_mpput(sink, 0xd1, (uint64_t)i, 2);
+    } else if (i >= INT32_MIN) {
+        sjson_mpput(sink, 0xd2, (uint64_t)i, 4);
+    } else {
+        sjson_mpput(sink, 0xd3, (uint64_t)i, 8);
     }
-    return SJSON_ERR_NO_MATCHING_MEMBER;
 }
 
-sjson_result sjson_deserialize(const char *s, size_t len) {
-    sjsonlexer lexer;
-    sjson_result json;
-    sjsonlexer_init(&lexer, s, len);
-    SjsonResult lexres = sjsonlexer_lex(&lexer);
-    if (lexres != SJSON_SUCCESS)
-        return (sjson_result){.err = lexres};
-    json = sjson_parse(&lexer.toks);
-    free(lexer.toks.a);
-    if (json.err)
-        return (sjson_result){.err = json.err};
-    return json;
+static void sjson_mpnumber(sjsonsink *sink, sjson *json) {
+    double num = json->v.num;
+    float f = (float)num;
+    /* x.i is stale if v.num was assigned after parsing */
+    if ((json->flags & SJSON_FLAG_INT) && (double)json->x.i == num) {
+        sjson_mpint(sink, json->x.i);
+    } else if (num >= -9223372036854775808.0 && num < 9223372036854775808.0 &&
+               num == (double)(int64_t)num && !(num == 0 && signbit(num))) {
+        sjson_mpint(sink, (int64_t)num);
+    } else if ((double)f == num) {
+        uint32_t bits;
+        memcpy(&bits, &f, sizeof(bits));
+        sjson_mpput(sink, 0xca, bits, 4);
+    } else {
+        uint64_t bits;
+        memcpy(&bits, &num, sizeof(bits));
+        sjson_mpput(sink, 0xcb, bits, 8);
+    }
 }
 
-sjsonbuf sjson_serialize(sjson *json) {
-    sjsonbuf s;
-    sjsonbuf_init(&s);
+/* like sjson_emitvalue, true if json is a container with children */
+static bool sjson_mpvalue(sjsonsink *sink, sjson *json) {
+    size_t n = 0;
     switch (json->type) {
-    case SJSON_NUMBER: {
-        char buf[1024];
-        size_t len = snprintf(buf, sizeof buf, "%lf", json->v.num);
-        sjsonbuf_push(&s, buf, len);
+    case SJSON_NUMBER:
+        sjson_mpnumber(sink, json);
         break;
-    }
     case SJSON_STRING:
-        sjsonbuf_push(&s, "\"", 1);
-        for (const char *c = json->v.str; *c; c++) {
-            switch (*c) {
-            case '\"':
-                sjsonbuf_push(&s, "\\\"", 2);
-                break;
-            case '\n':
-                sjsonbuf_push(&s, "\\n", 2);
-                break;
-            case '\r':
-                sjsonbuf_push(&s, "\\r", 2);
-                break;
-            case '\f':
-                sjsonbuf_push(&s, "\\f", 2);
-                break;
-            case '\t':
-                sjsonbuf_push(&s, "\\t", 2);
-                break;
-            case '\\':
-                sjsonbuf_push(&s, "\\\\", 2);
-                break;
-            case '/':
-                sjsonbuf_push(&s, "\\/", 2);
-                break;
-            default:
-                sjsonbuf_push(&s, c, 1);
-                break;
-            }
-        }
-        sjsonbuf_push(&s, "\"", 1);
+        sjson_mpstr(sink, json->v.str, sjson_strlen(json));
         break;
     case SJSON_NULL:
-        sjsonbuf_push(&s, "null", 4);
+        sjson_mpput(sink, 0xc0, 0, 0);
         break;
     case SJSON_TRUE:
-        sjsonbuf_push(&s, "true", 4);
+        sjson_mpput(sink, 0xc3, 0, 0);
         break;
     case SJSON_FALSE:
-        sjsonbuf_push(&s, "false", 5);
+        sjson_mpput(sink, 0xc2, 0, 0);
         break;
     case SJSON_OBJECT:
-        sjsonbuf_push(&s, "{", 1);
-        sjson_foreach(json, it) {
-            sjsonbuf_push(&s, "\"", 1);
-            sjsonbuf_push(&s, it->key, strlen(it->key));
-            sjsonbuf_push(&s, "\"", 1);
-            sjsonbuf_push(&s, ":", 1);
-            sjsonbuf childbuf = sjson_serialize(it);
-            sjsonbuf_push(&s, childbuf.buf, childbuf.len);
-            free(childbuf.buf);
-            if (it->next != NULL)
-                sjsonbuf_push(&s, ",", 1);
-        }
-        sjsonbuf_push(&s, "}", 1);
-        break;
     case SJSON_ARRAY:
-        sjsonbuf_push(&s, "[", 1);
-        sjson_foreach(json, it) {
-            sjsonbuf childbuf = sjson_serialize(it);
-            sjsonbuf_push(&s, childbuf.buf, childbuf.len);
-            free(childbuf.buf);
-            if (it->next != NULL)
-                sjsonbuf_push(&s, ",", 1);
-        }
-        sjsonbuf_push(&s, "]", 1);
-        break;
+        sjson_foreach(json, child) {
+            n++;
+        }
+        if (json->type == SJSON_OBJECT)
+            sjson_mplen(sink, n, 0x80, 15, 0, 0xde);
+        else
+            sjson_mplen(sink, n, 0x90, 15, 0, 0xdc);
+        return n > 0;
     case SJSON_INVALID:
     default:
         break;
     }
-    return s;
+    return false;
+}
+
+SjsonResult sjson_msgpack_encode(sjson *json, sjsonbuf *buf) {
+    sjson *local[32], **stack = local;
+    size_t depth = 0, cap = sizeof(local) / sizeof(*local);
+    sjsonsink sink = {.buf = buf};
+    SjsonResult err;
+
+    /* same walk as sjson_emit, containers have no closing byte */
+    for (;;) {
+        if (depth > 0 && stack[depth - 1]->type == SJSON_OBJECT)
+            sjson_mpstr(&sink, json->key, sjson_keylen(json));
+        if ((json->flags & SJSON_FLAG_LAZY) && (err = sjson_expand(json))) {
+            sink.err = err;
+            break;
+        }
+        if (sjson_mpvalue(&sink, json)) {
+            if (depth == cap) {
+                sjson **grown = (sjson **)sjson_stackgrow(
+                    stack, &cap, sizeof(*stack), local);
+                if (grown == NULL) {
+                    sink.err = SJSON_ERR_NO_MEMORY;
+                    break;
+                }
+                stack = grown;
+            }
+            stack[depth++] = json;
+            json = json->v.child;
+            continue;
+        }
+        while (depth > 0 && json->next == NULL)
+            json = stack[--depth];
+        if (depth == 0 || sink.err)
+            break;
+        json = json->next;
+    }
+    if (stack != local)
+        free(stack);
+    return sink.err;
+}
+
+/* n bytes at p, big-endian */
+static uint64_t sjson_mpget(const char *p, int n) {
+    uint64_t v = 0;
+    for (int i = 0; i < n; i++)
+        v = v << 8 | (unsigned char)p[i];
+    return v;
+}
+
+/* str at *p as a string token, a slice of the source with
+ * SJSON_OPT_ZEROCOPY, else a terminated copy, *p is moved past it */
+static SjsonResult sjson_mpreadstr(sjsonparser *parser, const char **p,
+                                   sjsontok *tok) {
+    const char *end = parser->lexer.end;
+    unsigned char tag;
+    size_t len, n;
+    if (*p >= end)
+        return SJSON_ERR_INVALID_SOURCE;
+    tag = (unsigned char)**p;
+    if ((tag & 0xe0) == 0xa0) {
+        len = tag & 0x1f;
+        n = 0;
+    } else if (tag >= 0xd9 && tag <= 0xdb) {
+        n = (size_t)1 << (tag - 0xd9);
+        if ((size_t)(end - *p - 1) < n)
+            return SJSON_ERR_INVALID_SOURCE;
+        len = (size_t)sjson_mpget(*p + 1, (int)n);
+    } else {
+        return SJSON_ERR_WRONG_TYPE;
+    }
+    const char *str = *p + 1 + n;
+    if ((size_t)(end - str) < len)
+        return SJSON_ERR_INVALID_SOURCE;
+    if ((parser->lexer.flags & SJSON_OPT_VALIDATE_UTF8) &&
+        !sjson_utf8_valid(str, len))
+        return SJSON_ERR_INVALID_UTF8;
+    *p = str + len;
+    /* an empty slice at the very end would pass for a copy */
+    if (len == 0 && (parser->lexer.flags & SJSON_OPT_ZEROCOPY))
+        str--;
+    if (!(parser->lexer.flags & SJSON_OPT_ZEROCOPY)) {
+        char *buf = (char *)sjsonlexer_alloc(&parser->lexer, len + 1);
+        if (buf == NULL)
+            return SJSON_ERR_NO_MEMORY;
+        memcpy(buf, str, len);
+        buf[len] = '\x0';
+        str = buf;
+    }
+    *tok = (sjsontok){SJSON_TKSTRINGLITERAL, str, str + len};
+    return SJSON_SUCCESS;
+}
+
+/* value at *p other than array or map contents, *p is moved past the
+ * value or the container's header, *n is the container's child count */
+static sjson_result sjson_mpreadvalue(sjsonparser *parser, const char **p,
+                                      size_t *n) {
+    const char *end = parser->lexer.end;
+    unsigned char tag;
+    int type, size = 0;
+    sjson_result ret;
+    sjsontok tok;
+    SjsonResult err;
+
+    if (*p >= end)
+        return (sjson_result){.err = SJSON_ERR_INVALID_SOURCE};
+    tag = (unsigned char)**p;
+
+    /* fixed length values, size bytes follow the tag */
+    if (tag <= 0x7f || tag >= 0xe0 || (tag >= 0xcc && tag <= 0xd3)) {
+        type = SJSON_NUMBER;
+        size = tag >= 0xcc && tag <= 0xd3 ? 1 << ((tag - 0xcc) & 3) : 0;
+    } else if (tag == 0xca || tag == 0xcb) {
+        type = SJSON_NUMBER;
+        size = tag == 0xca ? 4 : 8;
+    } else if (tag == 0xc0) {
+        type = SJSON_NULL;
+    } else if (tag == 0xc2 || tag == 0xc3) {
+        type = tag == 0xc3 ? SJSON_TRUE : SJSON_FALSE;
+    } else if ((tag & 0xe0) == 0xa0 || (tag >= 0xd9 && tag <= 0xdb)) {
+        if ((err = sjson_mpreadstr(parser, p, &tok)))
+            return (sjson_result){.err = err};
+        ret = sjson_newnode(parser, SJSON_STRING);
+        if (ret.err) {
+            if (sjsonparser_ownsstr(parser, &tok))
+                free((void *)tok.start);
+            return ret;
+        }
+        ret.json->v.str = tok.start;
+        ret.json->x.len = tok.end - tok.start;
+        ret.json->flags |= SJSON_FLAG_STRLEN;
+        if (sjsonparser_ownsstr(parser, &tok))
+            ret.json->flags |= SJSON_FLAG_OWNSTR;
+        return ret;
+    } else if ((tag & 0xe0) == 0x80 || (tag >= 0xdc && tag <= 0xdf)) {
+        type = (tag & 0xf0) == 0x80 || tag >= 0xde ? SJSON_OBJECT : SJSON_ARRAY;
+        size = tag >= 0xdc ? 2 << (tag & 1) : 0;
+    } else {
+        return (sjson_result){.err = SJSON_ERR_UNKNOWN_TOKEN};
+    }
+    if ((size_t)(end - *p - 1) < (size_t)size)
+        return (sjson_result){.err = SJSON_ERR_INVALID_SOURCE};
+    uint64_t v = sjson_mpget(*p + 1, size);
+    *p += 1 + size;
+
+    ret = sjson_newnode(parser, type);
+    if (ret.err)
+        return ret;
+    if (type == SJSON_OBJECT || type == SJSON_ARRAY) {
+        *n = size ? (size_t)v : tag & 0x0f;
+    } else if (tag == 0xca) {
+        float f;
+        uint32_t bits = (uint32_t)v;
+        memcpy(&f, &bits, sizeof(f));
+        ret.json->v.num = f;
+    } else if (tag == 0xcb) {
+        memcpy(&ret.json->v.num, &v, sizeof(v));
+    } else if (type == SJSON_NUMBER) {
+        int64_t i;
+        if (tag <= 0x7f || tag >= 0xe0)
+            i = (int8_t)tag;
+        else if (tag == 0xd0)
+            i = (int8_t)v;
+        else if (tag == 0xd1)
+            i = (int16_t)v;
+        else if (tag == 0xd2)
+            i = (int32_t)v;
+        else if (tag == 0xd3 || v <= INT64_MAX)
+            i = (int64_t)v;
+        else {
+            ret.json->v.num = (double)v;
+            return ret;
+        }
+        ret.json->x.i = i;
+        ret.json->v.num = (double)i;
+        ret.json->flags |= SJSON_FLAG_INT;
+    }
+    return ret;
+}
+
+sjson_result sjson_msgpack_decode(const char *s, size_t len,
+                                  const sjson_options *opt) {
+    struct sjsonparseframe local[32], *stack = local;
+    size_t depth = 0, cap = sizeof(local) / sizeof(*local), n = 0;
+    sjsonparser parser;
+    sjson *root = NULL;
+    sjsontok key = {0};
+    bool ownskey = false;
+    SjsonResult err;
+    const char *p = s;
+
+    sjsonlexer_init(&parser.lexer, s, len);
+    if (opt) {
+        parser.lexer.arena = opt->arena;
+        parser.lexer.flags = opt->flags & ~SJSON_OPT_LAZY;
+        parser.lexer.intern = opt->intern;
+        if (opt->max_depth)
+            parser.lexer.maxdepth = opt->max_depth;
+    }
+    /* stack[i].n counts children still to come */
+    for (;;) {
+        if (depth > 0 && stack[depth - 1].json->type == SJSON_OBJECT) {
+            if ((err = sjson_mpreadstr(&parser, &p, &key)))
+                goto fail;
+            ownskey = sjsonparser_ownsstr(&parser, &key);
+            if ((err = sjsonparser_internkey(&parser, &key, &ownskey)))
+                goto fail;
+        }
+        sjson_result val = sjson_mpreadvalue(&parser, &p, &n);
+        if (val.err) {
+            err = val.err;
+            goto fail;
+        }
+        if (depth == 0) {
+            root = val.json;
+        } else {
+            struct sjsonparseframe *top = &stack[depth - 1];
+            if (top->json->type == SJSON_OBJECT) {
+                val.json->key = key.start;
+                val.json->keylen = key.end - key.start;
+                val.json->flags |= SJSON_FLAG_KEYLEN;
+                if (ownskey)
+                    val.json->flags |= SJSON_FLAG_OWNKEY;
+                ownskey = false;
+            }
+            sjson_link(top->json, val.json);
+            top->n--;
+        }
+        if (val.json->type == SJSON_OBJECT || val.json->type == SJSON_ARRAY) {
+            if (depth >= parser.lexer.maxdepth) {
+                err = SJSON_ERR_MAX_DEPTH;
+                goto fail;
+            }
+            sjsonparser_indexstub(&parser, val.json, n);
+            if (n > 0) {
+                if (depth == cap) {
+                    struct sjsonparseframe *grown =
+                        (struct sjsonparseframe *)sjsonparser_growstack(
+                            &parser, stack, &cap, sizeof(*stack), local);
+                    if (grown == NULL) {
+                        err = SJSON_ERR_NO_MEMORY;
+                        goto fail;
+                    }
+                    stack = grown;
+                }
+                stack[depth++] = (struct sjsonparseframe){val.json, n};
+            }
+        }
+        while (depth > 0 && stack[depth - 1].n == 0)
+            depth--;
+        if (depth == 0)
+            break;
+    }
+    if (p != parser.lexer.end) {
+        err = SJSON_ERR_INVALID_SOURCE;
+        goto fail;
+    }
+    if (stack != local && parser.lexer.arena == NULL)
+        free(stack);
+    return (sjson_result){.json = root};
+
+fail:
+    if (ownskey)
+        free((void *)key.start);
+    if (stack != local && parser.lexer.arena == NULL)
+        free(stack);
+    if (root != NULL)
+        sjson_free(root);
+    return (sjson_result){.err = err};
 }
 
 #endif /* SHEEP_SJSON_IMPLEMENTATION */
@@ -0,0 +1,1030 @@
+#define SHEEP_SJSON_IMPLEMENTATION
+#include "../sjson.h"
+
+static int failed, checked;
+
+#define CHECK(cond)                                                            \
+    do {                                                                       \
+        checked++;                                                             \
+        if (!(cond)) {                                                         \
+            failed++;                                                          \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__,   \
+                    #cond);                                                    \
+        }                                                                      \
+    } while (0)
+
+#define CHECKSTR(a, b) CHECK(strcmp((a), (b)) == 0)
+
+static void describe(sjson *json, int depth) {
+    printf("%*s", depth * 2, "");
+    if (json->key)
+        printf("%.*s: ", (int)sjson_keylen(json), json->key);
+    switch (json->type) {
+    case SJSON_NUMBER:
+        printf("%g\n", json->v.num);
+        break;
+    case SJSON_STRING:
+        printf("\"%.*s\"\n", (int)sjson_strlen(json), json->v.str);
+        break;
+    case SJSON_OBJECT:
+    case SJSON_ARRAY:
+        printf("%s\n", json->type == SJSON_OBJECT ? "object" : "array");
+        sjson_foreach(json, child) {
+            describe(child, depth + 1);
+        }
+        break;
+    default:
+        printf("%s\n", sjson_type_names[json->type]);
+        break;
+    }
+}
+
+static sjson *parse(const char *s) {
+    sjson_result r = sjson_deserialize(s, strlen(s));
+    return r.err ? NULL : r.json;
+}
+
+static SjsonResult perr(const char *s) {
+    sjson_result r = sjson_deserialize(s, strlen(s));
+    if (!r.err)
+        sjson_free(r.json);
+    return r.err;
+}
+
+/* free node that was unlinked from its parent, not its old siblings */
+static void drop(sjson *json) {
+    json->next = json->prev = NULL;
+    sjson_free(json);
+}
+
+/* serialize json, caller frees */
+static char *dump(sjson *json) {
+    sjsonbuf buf = {0};
+    if (sjson_serialize_into(json, &buf))
+        return NULL;
+    return buf.buf;
+}
+
+/* s parses and serializes back to want */
+static bool roundtrip(const char *s, const char *want) {
+    sjson *json = parse(s);
+    if (json == NULL)
+        return false;
+    char *out = dump(json);
+    bool ok = out && strcmp(out, want) == 0;
+    if (!ok)
+        fprintf(stderr, "  %s -> %s, want %s\n", s, out ? out : "?", want);
+    free(out);
+    sjson_free(json);
+    return ok;
+}
+
+/* array of n objects, long enough to parse in parallel */
+static sjsonbuf bigarray(int n) {
+    sjsonbuf b = {0};
+    char item[128];
+    sjsonbuf_push(&b, "[", 1);
+    for (int i = 0; i < n; i++) {
+        int len = snprintf(item, sizeof(item),
+                           "%s{\"id\":%d,\"name\":\"n%d\",\"v\":[%d.5,true]}",
+                           i ? "," : "", i, i, i);
+        sjsonbuf_push(&b, item, len);
+    }
+    sjsonbuf_push(&b, "]", 1);
+    return b;
+}
+
+static void test_arena(void) {
+    const char *s = "{\"a\":[true,\"two\",{\"b\":null}],\"c\":\"x\\ny\"}";
+    sjson_arena arena = {0};
+    sjson_result r = sjson_deserialize_arena(&arena, s, strlen(s));
+    CHECK(r.err == 0);
+    CHECK(r.json->flags & SJSON_FLAG_ARENA);
+    char *out = dump(r.json);
+    CHECKSTR(out, s);
+    free(out);
+    sjson_free(r.json); /* no-op */
+    sjson_arena_free(&arena);
+    CHECK(arena.head == NULL);
+
+    void *p = sjson_arena_alloc(&arena, 3), *q = sjson_arena_alloc(&arena, 100000);
+    CHECK(p && q && ((uintptr_t)q % SJSON_ARENA_ALIGN) == 0);
+    sjson_arena_free(&arena);
+}
+
+static void test_parser(void) {
+    CHECK(roundtrip(" { \"a\" : [ \"x\" , null ] , \"b\" : { } , \"c\" : [ ] } ",
+                    "{\"a\":[\"x\",null],\"b\":{},\"c\":[]}"));
+    CHECK(roundtrip("[true,false,null]", "[true,false,null]"));
+    CHECK(perr("[1,2,]") == SJSON_ERR_TRAILING_COMMA);
+    CHECK(perr("{\"a\":1,}") == SJSON_ERR_TRAILING_COMMA);
+    CHECK(perr("{\"a\":1") == SJSON_ERR_NO_TERMINATING_BRACE);
+    CHECK(perr("[1 2]") == SJSON_ERR_NO_TERMINATING_BRACKET);
+    CHECK(perr("\"abc") == SJSON_ERR_NO_TERMINATING_DOUBLE_QUOTE);
+    CHECK(perr("[1] 2") == SJSON_ERR_INVALID_SOURCE);
+    CHECK(perr("{1:2}") == SJSON_ERR_INVALID_SOURCE);
+    CHECK(perr("nul") == SJSON_ERR_INVALID_SOURCE);
+    CHECK(perr("[\"a\", tru]") != 0);
+}
+
+static void test_zerocopy(void) {
+    const char *s = "{\"plain\":\"abc\",\"esc\":\"a\\tb\"}";
+    sjson_options opt = {.flags = SJSON_OPT_ZEROCOPY};
+    sjson_result r = sjson_deserialize_ex(s, strlen(s), &opt);
+    CHECK(r.err == 0);
+    sjson *plain = sjson_object_get(r.json, "plain").json;
+    sjson *esc = sjson_object_get(r.json, "esc").json;
+    CHECK(plain->v.str >= s && plain->v.str < s + strlen(s));
+    CHECK(plain->x.len == 3 && memcmp(plain->v.str, "abc", 3) == 0);
+    CHECK(plain->key >= s && plain->keylen == 5);
+    CHECK(!(esc->v.str >= s && esc->v.str < s + strlen(s)));
+    CHECK(esc->x.len == 3 && memcmp(esc->v.str, "a\tb", 3) == 0);
+    sjson_free(r.json);
+}
+
+static void test_structural(void) {
+    const char *s = "{\"a\":[1,\"x,y\"]}";
+    const uint32_t want[] = {0, 1, 4, 5, 6, 7, 8, 13, 14};
+    sjson_structural idx = {0};
+    CHECK(sjson_structural_index(s, strlen(s), &idx) == 0);
+    CHECK(idx.len == sizeof(want) / sizeof(*want));
+    CHECK(idx.len == 9 && memcmp(idx.pos, want, sizeof(want)) == 0);
+
+    /* escaped quotes and backslashes across 64 byte blocks */
+    sjsonbuf b;
+    sjsonbuf_init(&b);
+    sjsonbuf_push(&b, "[\"", 2);
+    for (int i = 0; i < 100; i++)
+        sjsonbuf_push(&b, i % 7 ? "\\\\,{" : "\\\",[", 4);
+    sjsonbuf_push(&b, "\",2]", 4);
+    CHECK(sjson_structural_index(b.buf, b.len, &idx) == 0);
+    CHECK(idx.len == 5);
+    CHECK(idx.len == 5 && idx.pos[2] == b.len - 3 && idx.pos[4] == b.len - 1);
+    sjson *json = parse(b.buf);
+    CHECK(json && json->v.child->x.len == 300);
+    sjson_free(json);
+    free(b.buf);
+    sjson_structural_free(&idx);
+}
+
+static void test_numbers(void) {
+    sjson *json = parse("[0,-0,-7,9007199254740993,-9223372036854775808,"
+                        "1e3,-2.5E-3,1.5e+2,0.1,123456789012345678901]");
+    CHECK(json != NULL);
+    sjson *n = json->v.child;
+    CHECK((n->flags & SJSON_FLAG_INT) && n->x.i == 0);
+    n = n->next;
+    CHECK(!(n->flags & SJSON_FLAG_INT) && n->v.num == 0 && signbit(n->v.num));
+    n = n->next;
+    CHECK((n->flags & SJSON_FLAG_INT) && n->x.i == -7 && n->v.num == -7);
+    n = n->next;
+    CHECK((n->flags & SJSON_FLAG_INT) && n->x.i == 9007199254740993LL);
+    n = n->next;
+    CHECK((n->flags & SJSON_FLAG_INT) && n->x.i == INT64_MIN);
+    n = n->next;
+    CHECK(n->v.num == 1000);
+    n = n->next;
+    CHECK(n->v.num == -2.5e-3);
+    n = n->next;
+    CHECK(n->v.num == 150);
+    n = n->next;
+    CHECK(n->v.num == 0.1 && !(n->flags & SJSON_FLAG_INT));
+    n = n->next;
+    CHECK(n->v.num == 123456789012345678901.0 && !(n->flags & SJSON_FLAG_INT));
+    sjson_free(json);
+    CHECK(perr("-") != 0);
+    CHECK(perr("1e") != 0);
+    CHECK(perr("1.") != 0);
+    CHECK(perr("[.5]") != 0);
+}
+
+static size_t chunks;
+
+static int collect(void *ctx, const char *data, size_t len) {
+    chunks++;
+    return sjsonbuf_push((sjsonbuf *)ctx, data, len) != 0;
+}
+
+static int failwrite(void *ctx, const char *data, size_t len) {
+    (void)ctx, (void)data, (void)len;
+    return 1;
+}
+
+static void test_serialize(void) {
+    sjsonbuf src = bigarray(2000), into = {0}, to = {0};
+    sjson *json = parse(src.buf);
+    CHECK(json != NULL);
+    sjsonbuf whole = sjson_serialize(json);
+    CHECK(sjson_serialize_into(json, &into) == 0);
+    CHECKSTR(into.buf, whole.buf);
+    CHECK(sjson_serialize_to(json, collect, &to) == 0);
+    CHECK(to.len == whole.len && memcmp(to.buf, whole.buf, whole.len) == 0);
+    CHECK(chunks > 1 && chunks <= whole.len / SJSON_WRITE_CHUNK + 2);
+    CHECK(sjson_serialize_to(json, failwrite, NULL) == SJSON_ERR_WRITE);
+
+    FILE *fp = tmpfile();
+    CHECK(sjson_serialize_to(json, sjson_write_file, fp) == 0);
+    CHECK(ftell(fp) == (long)whole.len);
+    fclose(fp);
+    sjson_free(json);
+    free(src.buf);
+    free(whole.buf);
+    free(into.buf);
+    free(to.buf);
+}
+
+static void test_dtoa(void) {
+    CHECK(roundtrip("[1e-9,0.1,-0.5,1.5e300,5e-324,123.456,1e21,100]",
+                    "[1e-9,0.1,-0.5,1.5e300,5e-324,123.456,1e21,100]"));
+    CHECK(roundtrip("[2.0,1E2,0.000001]", "[2,100,0.000001]"));
+    CHECK(roundtrip("[-0,-0.0,0,-0e5]", "[-0,-0,0,-0]"));
+
+    /* random doubles parse back bit-exactly */
+    uint64_t x = 88172645463325252ULL;
+    for (int i = 0; i < 20000; i++) {
+        double d, back;
+        char buf[32];
+        x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+        memcpy(&d, &x, sizeof(d));
+        if (!isfinite(d))
+            continue;
+        size_t len = sjson_dtoa(d, buf);
+        buf[len] = '\x0';
+        sjson *json = parse(buf);
+        CHECK(json != NULL);
+        if (json == NULL)
+            continue;
+        back = json->v.num;
+        if (memcmp(&back, &d, sizeof(d)) != 0) {
+            fprintf(stderr, "  %.17g -> %s\n", d, buf);
+            CHECK(false);
+        }
+        sjson_free(json);
+    }
+
+    sjson *nan = sjson_new(SJSON_NUMBER).json;
+    nan->v.num = NAN;
+    char *out = dump(nan);
+    CHECKSTR(out, "null");
+    free(out);
+    sjson_free(nan);
+}
+
+static void test_object_index(void) {
+    sjson *json = sjson_new(SJSON_OBJECT).json;
+    static char keys[200][16];
+    for (int i = 0; i < 200; i++) {
+        sjson *v = sjson_new(SJSON_NUMBER).json;
+        snprintf(keys[i], sizeof(keys[i]), "k%d", i);
+        v->v.num = i;
+        sjson_object_set(json, keys[i], v);
+    }
+    CHECK(sjson_object_get(json, "k0").json->v.num == 0);
+    CHECK(json->index != NULL && json->index->slots != NULL);
+    for (int i = 0; i < 200; i++)
+        CHECK(sjson_object_get(json, keys[i]).json->v.num == i);
+    CHECK(sjson_object_get(json, "k200").err == SJSON_ERR_NO_MATCHING_MEMBER);
+
+    /* updates through the index, order of the rest is kept */
+    sjson *v = sjson_new(SJSON_TRUE).json;
+    sjson *old5 = sjson_object_get(json, "k5").json;
+    sjson *old7 = sjson_object_get(json, "k7").json;
+    sjson *old8 = sjson_object_get(json, "k8").json;
+    sjson_object_set(json, keys[5], v);
+    CHECK(sjson_object_get(json, "k5").json == v);
+    CHECK(json->x.tail == v);
+    CHECK(sjson_object_delete_all(json, "k7") == 0);
+    CHECK(sjson_object_get(json, "k7").err == SJSON_ERR_NO_MATCHING_MEMBER);
+    CHECK(sjson_deletechild(json, old8) == 0);
+    CHECK(sjson_object_get(json, "k8").err == SJSON_ERR_NO_MATCHING_MEMBER);
+    drop(old5);
+    drop(old7);
+    drop(old8);
+    CHECK(sjson_object_get(json, "k9").json->v.num == 9);
+    char *out = dump(json);
+    CHECK(strncmp(out, "{\"k0\":0,\"k1\":1,\"k2\":2,\"k3\":3,\"k4\":4,\"k6\":6,"
+                       "\"k9\":9,", 42) == 0);
+    free(out);
+    sjson_free(json);
+
+    /* duplicate keys, first one wins */
+    json = parse("{\"a\":1,\"b\":2,\"c\":3,\"d\":4,\"e\":5,\"f\":6,\"g\":7,"
+                 "\"h\":8,\"i\":9,\"j\":10,\"k\":11,\"l\":12,\"m\":13,\"n\":14,"
+                 "\"o\":15,\"p\":16,\"a\":17}");
+    CHECK(sjson_object_get(json, "a").json->v.num == 1);
+    sjson_free(json);
+}
+
+static void test_array_index(void) {
+    sjson *json = sjson_new(SJSON_ARRAY).json;
+    for (int i = 0; i < 1000; i++) {
+        sjson *v = sjson_new(SJSON_NUMBER).json;
+        v->v.num = i;
+        sjson_array_push(json, v);
+    }
+    for (int i = 0; i < 1000; i++)
+        CHECK(sjson_array_get(json, i).json->v.num == i);
+    CHECK(json->index != NULL && json->index->items != NULL);
+    CHECK(sjson_array_get(json, 1000).err != 0);
+
+    sjson *x = sjson_new(SJSON_NULL).json;
+    CHECK(sjson_array_set(json, 500, x) == 0);
+    CHECK(sjson_array_get(json, 500).json == x);
+    sjson *first = json->v.child;
+    CHECK(sjson_array_delete(json, 0) == 0);
+    drop(first);
+    CHECK(sjson_array_get(json, 0).json->v.num == 1);
+    CHECK(sjson_array_get(json, 499).json == x);
+    CHECK(sjson_array_get(json, 998).json->v.num == 999);
+    size_t n = 0;
+    sjson_foreach(json, child) {
+        n++;
+    }
+    CHECK(n == 999);
+    sjson_free(json);
+
+    sjson_arena arena = {0};
+    sjsonbuf src = bigarray(100);
+    json = sjson_deserialize_arena(&arena, src.buf, src.len).json;
+    CHECK(sjson_array_get(json, 77).json->v.child->v.num == 77);
+    sjson_arena_free(&arena);
+    free(src.buf);
+}
+
+/* event stream of s fed step bytes at a time, as a compact string */
+static void pullevents(const char *s, size_t step, sjsonbuf *out, int *err) {
+    sjson_pull pull = {0};
+    sjson_event ev;
+    size_t len = strlen(s), at = 0;
+    *err = 0;
+    for (;;) {
+        SjsonResult ret = sjson_pull_next(&pull, &ev);
+        if (ret == SJSON_ERR_NEED_INPUT) {
+            size_t n = len - at < step ? len - at : step;
+            sjson_pull_feed(&pull, s + at, n, at + n == len);
+            at += n;
+            continue;
+        }
+        if (ret) {
+            *err = ret;
+            break;
+        }
+        if (ev.tok.type == SJSON_TKINVALID)
+            break;
+        char tag[2] = {0};
+        switch (ev.tok.type) {
+        case SJSON_TKLBRACE:
+            tag[0] = '{';
+            break;
+        case SJSON_TKRBRACE:
+            tag[0] = '}';
+            break;
+        case SJSON_TKLSQUAREBRACKET:
+            tag[0] = '[';
+            break;
+        case SJSON_TKRSQUAREBRACKET:
+            tag[0] = ']';
+            break;
+        case SJSON_TKNUMBERLITERAL: {
+            char num[32];
+            int n = snprintf(num, sizeof(num), "#%g", ev.tok.num);
+            sjsonbuf_push(out, num, n);
+            break;
+        }
+        case SJSON_TKSTRINGLITERAL:
+            sjsonbuf_push(out, ev.iskey ? "k" : "s", 1);
+            sjsonbuf_push(out, ev.tok.start, ev.tok.end - ev.tok.start);
+            break;
+        default:
+            tag[0] = sjson_token_names[ev.tok.type][8];
+            break;
+        }
+        sjsonbuf_push(out, tag, strlen(tag));
+        sjsonbuf_push(out, " ", 1);
+    }
+    sjson_pull_free(&pull);
+}
+
+static void test_pull(void) {
+    const char *s = "{\"key\":[12.5,\"st\\u00e9r\",true,null,{}],\"k2\":-3e2}";
+    const char *want = "{ kkey [ #12.5 sst\xc3\xa9r T N { } ] kk2 #-300 } ";
+    for (size_t step = 1; step <= strlen(s); step++) {
+        sjsonbuf out = {0};
+        int err;
+        pullevents(s, step, &out, &err);
+        CHECK(err == 0);
+        CHECK(out.buf && strcmp(out.buf, want) == 0);
+        free(out.buf);
+    }
+    sjsonbuf out = {0};
+    int err;
+    pullevents("[1,2", 1, &out, &err);
+    CHECK(err != 0);
+    free(out.buf);
+    out = (sjsonbuf){0};
+    pullevents("[1,]", 2, &out, &err);
+    CHECK(err == SJSON_ERR_TRAILING_COMMA);
+    free(out.buf);
+}
+
+static void test_lines(void) {
+    const char *s = "{\"a\":1}\n\n[2,\"x\"]\r\n{bad}\n\"last\"";
+    sjson_batch batch = {0};
+    CHECK(sjson_deserialize_lines(s, strlen(s), 3, NULL, &batch) == 0);
+    CHECK(batch.len == 4);
+    if (batch.len == 4) {
+        char *out = dump(batch.records[0].json);
+        CHECKSTR(out, "{\"a\":1}");
+        free(out);
+        out = dump(batch.records[1].json);
+        CHECKSTR(out, "[2,\"x\"]");
+        free(out);
+        CHECK(batch.records[2].err != 0);
+        CHECK(batch.records[3].json->type == SJSON_STRING);
+    }
+    sjson_batch_free(&batch);
+
+    sjsonbuf big = {0};
+    for (int i = 0; i < 20000; i++) {
+        char line[64];
+        int n = snprintf(line, sizeof(line), "{\"i\":%d,\"s\":\"a\\nb\"}\n", i);
+        sjsonbuf_push(&big, line, n);
+    }
+    CHECK(sjson_deserialize_lines(big.buf, big.len, 4, NULL, &batch) == 0);
+    CHECK(batch.len == 20000);
+    bool ordered = true;
+    for (size_t i = 0; i < batch.len; i++)
+        ordered = ordered && !batch.records[i].err &&
+                  batch.records[i].json->v.child->v.num == (double)i;
+    CHECK(ordered);
+    sjson_batch_free(&batch);
+    free(big.buf);
+}
+
+static char *tmppath(const char *name) {
+    static char path[256];
+    snprintf(path, sizeof(path), "/tmp/sjson_test_%s", name);
+    return path;
+}
+
+static void writefile(const char *path, const char *s) {
+    FILE *fp = fopen(path, "wb");
+    fputs(s, fp);
+    fclose(fp);
+}
+
+static void test_file(void) {
+    const char *s = "{\"name\":\"value\",\"list\":[1,2,3]}";
+    char *path = tmppath("file.json");
+    sjson_file file;
+    writefile(path, s);
+
+    sjson_result r = sjson_deserialize_file(path, NULL, &file);
+    CHECK(r.err == 0 && file.data == NULL);
+    char *out = dump(r.json);
+    CHECKSTR(out, s);
+    free(out);
+    sjson_free(r.json);
+
+    sjson_options opt = {.flags = SJSON_OPT_ZEROCOPY};
+    r = sjson_deserialize_file(path, &opt, &file);
+    CHECK(r.err == 0 && file.data != NULL);
+    sjson *name = sjson_object_get(r.json, "name").json;
+    CHECK(name->v.str >= file.data && name->v.str < file.data + file.len);
+    sjson_free(r.json);
+    sjson_file_close(&file);
+
+    /* lazy containers are expanded from the mapping later on */
+    opt.flags = SJSON_OPT_LAZY;
+    r = sjson_deserialize_file(path, &opt, &file);
+    CHECK(r.err == 0 && file.data != NULL);
+    sjson *list = sjson_object_get(r.json, "list").json;
+    CHECK(sjson_array_get(list, 2).json->v.num == 3);
+    sjson_free(r.json);
+    sjson_file_close(&file);
+
+    CHECK(sjson_deserialize_file(tmppath("missing"), NULL, &file).err ==
+          SJSON_ERR_READ);
+    remove(path);
+}
+
+static void test_lazy(void) {
+    const char *s = "{\"a\":{\"deep\":[1,2,{\"x\":\"y\"}]},\"b\":[true, 1e2 ],"
+                    "\"bad\":[1,,2],\"n\":5}";
+    sjson_options opt = {.flags = SJSON_OPT_LAZY};
+    sjson_result r = sjson_deserialize_ex(s, strlen(s), &opt);
+    CHECK(r.err == 0);
+    sjson *a = sjson_object_get(r.json, "a").json;
+    CHECK(a->flags & SJSON_FLAG_LAZY);
+    sjson *deep = sjson_object_get(a, "deep").json;
+    CHECK(!(a->flags & SJSON_FLAG_LAZY) && (deep->flags & SJSON_FLAG_LAZY));
+    sjson *x = sjson_object_get(sjson_array_get(deep, 2).json, "x").json;
+    CHECK(x->x.len == 1 && x->v.str[0] == 'y');
+    CHECK(sjson_object_get(r.json, "n").json->v.num == 5);
+    sjson *bad = sjson_object_get(r.json, "bad").json;
+    CHECK(sjson_expand(bad) != 0 && (bad->flags & SJSON_FLAG_LAZY));
+    CHECK(sjson_array_get(bad, 0).err != 0);
+    /* v.child of a lazy container or a string is its source */
+    CHECK(sjson_child(bad) == NULL && sjson_child(x) == NULL);
+    CHECK(sjson_array_get(x, 0).err == SJSON_ERR_NO_MATCHING_MEMBER);
+    /* unexpanded containers are written as their source */
+    char *out = dump(r.json);
+    CHECK(strstr(out, "\"b\":[true, 1e2 ]") != NULL);
+    free(out);
+    sjson_free(r.json);
+
+    /* arena documents expand into their arena */
+    sjson_arena arena = {0};
+    sjsonbuf src = bigarray(100);
+    opt.arena = &arena;
+    r = sjson_deserialize_ex(src.buf, src.len, &opt);
+    CHECK(r.err == 0);
+    sjson *item = sjson_array_get(r.json, 42).json;
+    CHECK(item->flags & SJSON_FLAG_ARENA);
+    sjson *id = sjson_object_get(item, "id").json;
+    CHECK((id->flags & SJSON_FLAG_ARENA) && id->v.num == 42);
+    sjson_arena_free(&arena);
+    free(src.buf);
+}
+
+static void test_query(void) {
+    const char *s = "{\"users\":[{\"name\":\"ann\",\"a/b\":1,\"m~n\":2},"
+                    "{\"name\":\"bob\",\"tags\":[\"x\"]}],\"0\":\"zero\"}";
+    const char *paths[] = {"/users/1/name", "users.1.name", "/users/0/a~1b",
+                           "/users/0/m~0n", "/0", "users.1.tags.0", ""};
+    const char *want[] = {"\"bob\"", "\"bob\"", "1", "2",
+                          "\"zero\"", "\"x\"", s};
+    for (size_t i = 0; i < sizeof(paths) / sizeof(*paths); i++) {
+        sjson_query q;
+        const char *v;
+        size_t len;
+        CHECK(sjson_query_compile(paths[i], &q) == 0);
+        CHECK(sjson_query_find(&q, s, strlen(s), &v, &len) == 0);
+        CHECK(len == strlen(want[i]) && memcmp(v, want[i], len) == 0);
+        sjson_query_free(&q);
+    }
+
+    sjson_query q;
+    const char *v;
+    size_t len;
+    sjson_query_compile("/users/2", &q);
+    CHECK(sjson_query_find(&q, s, strlen(s), &v, &len) ==
+          SJSON_ERR_NO_MATCHING_MEMBER);
+    sjson_query_free(&q);
+    sjson_query_compile("users.0.name.x", &q);
+    CHECK(sjson_query_find(&q, s, strlen(s), &v, &len) == SJSON_ERR_WRONG_TYPE);
+    sjson_query_free(&q);
+    CHECK(sjson_query_compile("/a~2", &q) == SJSON_ERR_INVALID_ESCAPE_SEQUENCE);
+
+    sjson_query_compile("/users/1", &q);
+    sjson_result r = sjson_query_get(&q, s, strlen(s), NULL);
+    CHECK(r.err == 0);
+    char *out = dump(r.json);
+    CHECKSTR(out, "{\"name\":\"bob\",\"tags\":[\"x\"]}");
+    free(out);
+    sjson_free(r.json);
+    sjson_query_free(&q);
+}
+
+static void test_tape(void) {
+    const char *s = "{\"id\":-42,\"pi\":3.25,\"s\":\"a\\\"b\",\"list\":[true,"
+                    "false,null,{}],\"big\":12345678901234}";
+    sjson_tape tape = {0}, back = {0};
+    size_t v = 0, item = 0;
+    CHECK(sjson_tape_build(s, strlen(s), &tape) == 0);
+    CHECK(sjson_tape_type(&tape, 0) == SJSON_OBJECT);
+    CHECK(sjson_tape_count(&tape, 0) == 5);
+
+    char *path = tmppath("doc.tape");
+    FILE *fp = fopen(path, "wb");
+    CHECK(sjson_tape_write(&tape, sjson_write_file, fp) == 0);
+    fclose(fp);
+    CHECK(sjson_tape_open(path, &back) == 0);
+
+    const sjson_tape *tapes[] = {&tape, &back};
+    for (int t = 0; t < 2; t++) {
+        const sjson_tape *tp = tapes[t];
+        size_t len;
+        CHECK(sjson_tape_object_get(tp, 0, "id", &v) == 0);
+        CHECK(sjson_tape_int(tp, v) == -42);
+        CHECK(sjson_tape_object_get(tp, 0, "pi", &v) == 0);
+        CHECK(sjson_tape_num(tp, v) == 3.25);
+        CHECK(sjson_tape_object_get(tp, 0, "s", &v) == 0);
+        CHECKSTR(sjson_tape_str(tp, v, &len), "a\"b");
+        CHECK(len == 3);
+        CHECK(sjson_tape_object_get(tp, 0, "big", &v) == 0);
+        CHECK(sjson_tape_int(tp, v) == 12345678901234LL);
+        CHECK(sjson_tape_object_get(tp, 0, "list", &v) == 0);
+        CHECK(sjson_tape_array_get(tp, v, 3, &item) == 0);
+        CHECK(sjson_tape_type(tp, item) == SJSON_OBJECT);
+        CHECK(sjson_tape_array_get(tp, v, 4, &item) != 0);
+        CHECK(sjson_tape_object_get(tp, 0, "nope", &v) ==
+              SJSON_ERR_NO_MATCHING_MEMBER);
+        int n = 0;
+        sjson_tape_foreach(tp, 0, it) {
+            n++;
+            CHECK(sjson_tape_key(tp, it, NULL) != NULL);
+        }
+        CHECK(n == 5);
+    }
+    sjson_tape_free(&back);
+    sjson_tape_free(&tape);
+    remove(path);
+    writefile(path, "not a tape");
+    CHECK(sjson_tape_open(path, &back) == SJSON_ERR_READ);
+    remove(path);
+}
+
+static void test_compact(void) {
+    const char *s = "{\"a\":[1,2.5,\"s\"],\"b\":{\"c\":true},\"d\":\"e\"}";
+    sjson_arena arena = {0};
+    sjson_compact *root, *child, *item;
+    CHECK(sizeof(sjson_compact) == 16);
+    CHECK(sjson_compact_deserialize(&arena, s, strlen(s), 0, &root) == 0);
+    CHECK(root->type == SJSON_OBJECT && root->len == 3);
+    CHECK(sjson_compact_object_get(root, "a", &child) == 0);
+    CHECK(sjson_compact_array_get(child, 0, &item) == 0);
+    CHECK((item->flags & SJSON_FLAG_INT) && item->v.i == 1);
+    CHECK(sjson_compact_array_get(child, 1, &item) == 0 && item->v.num == 2.5);
+    CHECK(sjson_compact_array_get(child, 2, &item) == 0);
+    CHECKSTR(item->v.str, "s");
+    CHECK(sjson_compact_array_get(child, 3, &item) != 0);
+    CHECK(sjson_compact_object_get(root, "b", &child) == 0);
+    CHECK(sjson_compact_object_get(child, "c", &item) == 0);
+    CHECK(item->type == SJSON_TRUE);
+    int n = 0;
+    sjson_compact_foreach(root, it) {
+        CHECK(it[-1].type == SJSON_STRING);
+        n++;
+    }
+    CHECK(n == 3);
+    CHECK(sjson_compact_deserialize(&arena, "[1,", 3, 0, &root) != 0);
+    sjson_arena_free(&arena);
+}
+
+static void test_intern(void) {
+    sjson_intern table = {0};
+    sjson_options opt = {.intern = &table};
+    const char *s1 = "{\"alpha\":1,\"beta\":{\"alpha\":2}}";
+    const char *s2 = "[{\"beta\":3}]";
+    sjson *a = sjson_deserialize_ex(s1, strlen(s1), &opt).json;
+    sjson *b = sjson_deserialize_ex(s2, strlen(s2), &opt).json;
+    CHECK(a && b);
+    sjson *beta = sjson_object_get(a, "beta").json;
+    CHECK(beta->key == b->v.child->v.child->key);
+    CHECK(a->v.child->key == beta->v.child->key);
+    const char *k = sjson_intern_key(&table, "alpha", 5);
+    CHECK(k == a->v.child->key);
+    CHECK(sjson_object_get(a, (char *)k).json->v.num == 1);
+    CHECK(table.len == 2);
+    sjson_free(a);
+    sjson_free(b);
+    sjson_intern_free(&table);
+}
+
+static void test_escape(void) {
+    sjson *json = parse("\"\\u00e9\\ud83d\\ude00\\\"\\\\\\/\\b\\f\\n\\r\\t\"");
+    CHECK(json && json->x.len == 2 + 4 + 8);
+    CHECK(json && memcmp(json->v.str, "\xc3\xa9\xf0\x9f\x98\x80\"\\/\b\f\n\r\t",
+                         json->x.len) == 0);
+    char *out = dump(json);
+    CHECKSTR(out, "\"\xc3\xa9\xf0\x9f\x98\x80\\\"\\\\/\\b\\f\\n\\r\\t\"");
+    free(out);
+    sjson_free(json);
+    CHECK(perr("\"\\ud83d\"") == 0);
+    CHECK(perr("\"\\u12\"") == SJSON_ERR_INVALID_ESCAPE_SEQUENCE);
+    CHECK(perr("\"\\x\"") == SJSON_ERR_INVALID_ESCAPE_SEQUENCE);
+
+    sjsonbuf b = {0};
+    const char *s = "a\xc3\xa9\xf0\x9f\x98\x80\x01";
+    CHECK(sjson_escape(s, strlen(s), 0, &b) == 0);
+    CHECKSTR(b.buf, "a\xc3\xa9\xf0\x9f\x98\x80\\u0001");
+    b.len = 0;
+    CHECK(sjson_escape(s, strlen(s), SJSON_ESCAPE_ASCII, &b) == 0);
+    CHECKSTR(b.buf, "a\\u00e9\\ud83d\\ude00\\u0001");
+    b.len = 0;
+    CHECK(sjson_unescape("x\\ud83d\\ude00\\n", 15, &b) == 0);
+    CHECKSTR(b.buf, "x\xf0\x9f\x98\x80\n");
+    free(b.buf);
+}
+
+static void test_utf8(void) {
+    CHECK(sjson_utf8_valid("plain ascii", 11));
+    CHECK(sjson_utf8_valid("\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80", 9));
+    CHECK(!sjson_utf8_valid("\xc3\x28", 2));
+    CHECK(!sjson_utf8_valid("\xc0\xaf", 2));         /* overlong */
+    CHECK(!sjson_utf8_valid("\xed\xa0\x80", 3));     /* surrogate */
+    CHECK(!sjson_utf8_valid("\xf4\x90\x80\x80", 4)); /* above U+10FFFF */
+    CHECK(!sjson_utf8_valid("\xe2\x82", 2));         /* truncated */
+
+    /* error after a long ASCII run, past the vector fast path */
+    char buf[200];
+    memset(buf, 'a', sizeof(buf));
+    buf[150] = (char)0xff;
+    CHECK(!sjson_utf8_valid(buf, sizeof(buf)));
+
+    sjson_options opt = {.flags = SJSON_OPT_VALIDATE_UTF8};
+    const char *bad = "[\"ok\",\"\xc3\x28\"]", *good = "[\"\xc3\xa9\"]";
+    CHECK(sjson_deserialize_ex(bad, strlen(bad), &opt).err ==
+          SJSON_ERR_INVALID_UTF8);
+    CHECK(perr(bad) == 0);
+    sjson_result r = sjson_deserialize_ex(good, strlen(good), &opt);
+    CHECK(r.err == 0);
+    sjson_free(r.json);
+    opt.flags |= SJSON_OPT_LAZY;
+    CHECK(sjson_deserialize_ex(bad, strlen(bad), &opt).err ==
+          SJSON_ERR_INVALID_UTF8);
+}
+
+static void test_depth(void) {
+    size_t n = 100000;
+    char *s = (char *)malloc(2 * n + 1);
+    memset(s, '[', n);
+    memset(s + n, ']', n);
+    s[2 * n] = '\x0';
+    CHECK(perr(s) == SJSON_ERR_MAX_DEPTH);
+
+    sjson_options opt = {.max_depth = n};
+    sjson_result r = sjson_deserialize_ex(s, 2 * n, &opt);
+    CHECK(r.err == 0);
+    char *out = dump(r.json);
+    CHECK(out && strcmp(out, s) == 0);
+    free(out);
+    sjson_free(r.json);
+    opt.max_depth = n - 1;
+    CHECK(sjson_deserialize_ex(s, 2 * n, &opt).err == SJSON_ERR_MAX_DEPTH);
+    free(s);
+
+    /* wide arrays are freed without recursion too */
+    sjson *json = sjson_new(SJSON_ARRAY).json;
+    for (int i = 0; i < 200000; i++)
+        sjson_array_push(json, sjson_new(SJSON_NULL).json);
+    sjson_free(json);
+}
+
+static void test_parallel(void) {
+    sjsonbuf src = bigarray(20000);
+    sjson *serial = parse(src.buf);
+    char *want = dump(serial);
+    sjson_free(serial);
+
+    sjson_result r = sjson_deserialize_parallel(src.buf, src.len, 4, NULL);
+    CHECK(r.err == 0);
+    char *out = dump(r.json);
+    CHECKSTR(out, want);
+    CHECK(sjson_array_get(r.json, 12345).json->v.child->v.num == 12345);
+    free(out);
+    sjson_free(r.json);
+
+    sjson_arena arena = {0};
+    sjson_options opt = {.arena = &arena};
+    r = sjson_deserialize_parallel(src.buf, src.len, 3, &opt);
+    CHECK(r.err == 0);
+    out = dump(r.json);
+    CHECKSTR(out, want);
+    CHECK(sjson_array_get(r.json, 19999).json->v.child->v.num == 19999);
+    free(out);
+    sjson_arena_free(&arena);
+
+    /* same error as a single thread */
+    src.buf[src.len / 2] = '}';
+    CHECK(sjson_deserialize_parallel(src.buf, src.len, 4, NULL).err ==
+          perr(src.buf));
+    free(want);
+    free(src.buf);
+}
+
+static void test_cached(void) {
+    const char *s = "{\"a\":{\"x\":[1,2,3]},\"b\":{\"y\":\"z\"},\"c\":[4]}";
+    sjson *json = parse(s);
+    sjsonbuf buf = {0};
+    CHECK(sjson_serialize_cached(json, &buf) == 0);
+    CHECKSTR(buf.buf, s);
+    CHECK(sjson_serialize_cached(json, &buf) == 0);
+    CHECKSTR(buf.buf, s);
+
+    sjson *b = sjson_object_get(json, "b").json, *old = b->v.child;
+    /* cache state stays out of the public fields */
+    CHECK(b->x.tail == old && b->index != NULL && b->index->cachelen == 9);
+    sjson *v = sjson_new(SJSON_STRING).json;
+    v->v.str = "new";
+    sjson_object_set(b, "y", v);
+    drop(old);
+    CHECK(sjson_serialize_cached(json, &buf) == 0);
+    CHECKSTR(buf.buf, "{\"a\":{\"x\":[1,2,3]},\"b\":{\"y\":\"new\"},\"c\":[4]}");
+
+    sjson *x = sjson_object_get(sjson_object_get(json, "a").json, "x").json;
+    x->v.child->v.num = 7;
+    x->v.child->flags &= ~SJSON_FLAG_INT;
+    sjson_touch(x->v.child);
+    sjson *c = sjson_object_get(json, "c").json;
+    old = c->v.child;
+    sjson_array_delete(c, 0);
+    drop(old);
+    CHECK(sjson_serialize_cached(json, &buf) == 0);
+    char *full = dump(json);
+    CHECKSTR(buf.buf, full);
+    CHECKSTR(buf.buf, "{\"a\":{\"x\":[7,2,3]},\"b\":{\"y\":\"new\"},\"c\":[]}");
+    free(full);
+    sjson_free(json);
+
+    /* small arena containers have no index to cache in */
+    sjson_arena arena = {0};
+    sjsonbuf src = bigarray(100);
+    json = sjson_deserialize_arena(&arena, src.buf, src.len).json;
+    CHECK(sjson_serialize_cached(json, &buf) == 0);
+    sjson *id = sjson_object_get(sjson_array_get(json, 3).json, "id").json;
+    id->v.num = 33;
+    id->flags &= ~SJSON_FLAG_INT;
+    sjson_touch(id);
+    CHECK(sjson_serialize_cached(json, &buf) == 0);
+    CHECK(strstr(buf.buf, "{\"id\":33,\"name\":\"n3\"") != NULL);
+    full = dump(json);
+    CHECKSTR(buf.buf, full);
+    free(full);
+    free(buf.buf);
+    free(src.buf);
+    sjson_arena_free(&arena);
+}
+
+static void test_context(void) {
+    sjson_parser parser = {0};
+    const char *msgs[] = {"{\"type\":\"a\",\"v\":[1,2,3]}", "[\"b\",{}]",
+                          "{\"type\":\"c\",\"s\":\"x\\ny\"}"};
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < 3; i++) {
+            sjson_result r = sjson_parser_parse(&parser, msgs[i],
+                                                strlen(msgs[i]));
+            CHECK(r.err == 0);
+            char *out = dump(r.json);
+            CHECKSTR(out, msgs[i]);
+            free(out);
+        }
+    }
+    CHECK(sjson_parser_parse(&parser, "[1,", 3).err != 0);
+    sjson_parser_free(&parser);
+}
+
+static void test_writer(void) {
+    sjson_writer w = {0};
+    sjson *tree = parse("{\"t\":[1]}");
+    for (int round = 0; round < 2; round++) {
+        sjson_writer_begin_object(&w);
+        sjson_writer_key(&w, "a\"b", 3);
+        sjson_writer_int(&w, -42);
+        sjson_writer_key(&w, "list", 4);
+        sjson_writer_begin_array(&w);
+        sjson_writer_number(&w, 1e-9);
+        sjson_writer_string(&w, "x\ny", 3);
+        sjson_writer_bool(&w, true);
+        sjson_writer_null(&w);
+        sjson_writer_begin_object(&w);
+        sjson_writer_end_object(&w);
+        sjson_writer_json(&w, tree);
+        sjson_writer_end_array(&w);
+        CHECK(sjson_writer_end_object(&w) == 0);
+        CHECKSTR(w.buf.buf, "{\"a\\\"b\":-42,\"list\":[1e-9,\"x\\ny\",true,"
+                            "null,{},{\"t\":[1]}]}");
+        sjson_writer_reset(&w);
+    }
+    sjson_writer_free(&w);
+    sjson_free(tree);
+
+    /* calls out of place fail, nothing is written after */
+    sjson_writer_begin_array(&w);
+    CHECK(sjson_writer_end_object(&w) == SJSON_ERR_WRONG_TYPE);
+    CHECK(sjson_writer_end_array(&w) == SJSON_ERR_WRONG_TYPE);
+    CHECKSTR(w.buf.buf, "[");
+    sjson_writer_reset(&w);
+    CHECK(sjson_writer_end_array(&w) == SJSON_ERR_WRONG_TYPE);
+    CHECK(w.depth == 0);
+    sjson_writer_reset(&w);
+    sjson_writer_begin_array(&w);
+    CHECK(sjson_writer_key(&w, "k", 1) == SJSON_ERR_WRONG_TYPE);
+    sjson_writer_reset(&w);
+    sjson_writer_begin_object(&w);
+    CHECK(sjson_writer_null(&w) == SJSON_ERR_WRONG_TYPE);
+    sjson_writer_reset(&w);
+    sjson_writer_begin_object(&w);
+    sjson_writer_key(&w, "k", 1);
+    CHECK(sjson_writer_key(&w, "k", 1) == SJSON_ERR_WRONG_TYPE);
+    sjson_writer_reset(&w);
+    sjson_writer_null(&w);
+    CHECK(sjson_writer_null(&w) == SJSON_ERR_WRONG_TYPE);
+    CHECKSTR(w.buf.buf, "null");
+    sjson_writer_reset(&w);
+
+    /* nesting is tracked at any depth */
+    for (int i = 0; i < 100; i++)
+        sjson_writer_begin_array(&w);
+    sjson_writer_begin_object(&w);
+    CHECK(sjson_writer_end_array(&w) == SJSON_ERR_WRONG_TYPE);
+    sjson_writer_reset(&w);
+    for (int i = 0; i < 100; i++)
+        sjson_writer_begin_array(&w);
+    CHECK(sjson_writer_key(&w, "k", 1) == SJSON_ERR_WRONG_TYPE);
+    sjson_writer_reset(&w);
+    for (int i = 0; i < 100; i++) {
+        sjson_writer_begin_object(&w);
+        sjson_writer_key(&w, "k", 1);
+    }
+    sjson_writer_int(&w, 1);
+    for (int i = 0; i < 100; i++)
+        sjson_writer_end_object(&w);
+    CHECK(w.err == 0 && w.depth == 0 && w.buf.len == 100 * 6 + 1);
+    sjson_writer_free(&w);
+}
+
+static void test_msgpack(void) {
+    const char *s = "{\"a\":1,\"b\":[true,null,-1,1.5,\"x\",false,-33,200,"
+                    "0.1]}";
+    const unsigned char want[] = {
+        0x82, 0xa1, 'a',  0x01, 0xa1, 'b',  0x99, 0xc3, 0xc0, 0xff, 0xca,
+        0x3f, 0xc0, 0x00, 0x00, 0xa1, 'x',  0xc2, 0xd0, 0xdf, 0xcc, 0xc8,
+        0xcb, 0x3f, 0xb9, 0x99, 0x99, 0x99, 0x99, 0x99, 0x9a};
+    sjson *json = parse(s);
+    sjsonbuf mp = {0};
+    CHECK(sjson_msgpack_encode(json, &mp) == 0);
+    CHECK(mp.len == sizeof(want) && memcmp(mp.buf, want, mp.len) == 0);
+
+    sjson_result r = sjson_msgpack_decode(mp.buf, mp.len, NULL);
+    CHECK(r.err == 0);
+    char *out = dump(r.json);
+    CHECKSTR(out, s);
+    free(out);
+    sjson_free(r.json);
+
+    sjson_arena arena = {0};
+    sjson_options opt = {.arena = &arena, .flags = SJSON_OPT_ZEROCOPY};
+    r = sjson_msgpack_decode(mp.buf, mp.len, &opt);
+    CHECK(r.err == 0);
+    sjson *x = sjson_array_get(sjson_object_get(r.json, "b").json, 4).json;
+    CHECK(x->v.str >= mp.buf && x->v.str < mp.buf + mp.len);
+    sjson_arena_free(&arena);
+
+    /* every truncation fails */
+    for (size_t i = 0; i < mp.len; i++)
+        CHECK(sjson_msgpack_decode(mp.buf, i, NULL).err ==
+              SJSON_ERR_INVALID_SOURCE);
+    CHECK(sjson_msgpack_decode("\xc0\xc0", 2, NULL).err ==
+          SJSON_ERR_INVALID_SOURCE);
+    CHECK(sjson_msgpack_decode("\xc4\x01x", 3, NULL).err ==
+          SJSON_ERR_UNKNOWN_TOKEN);
+    CHECK(sjson_msgpack_decode("\x81\x01\x02", 3, NULL).err ==
+          SJSON_ERR_WRONG_TYPE);
+    CHECK(sjson_msgpack_decode("\xdd\xff\xff\xff\xff\xc0", 6, NULL).err ==
+          SJSON_ERR_INVALID_SOURCE);
+    free(mp.buf);
+    sjson_free(json);
+
+    /* long strings and containers take the wider formats */
+    sjsonbuf src = bigarray(3000);
+    json = parse(src.buf);
+    mp = (sjsonbuf){0};
+    CHECK(sjson_msgpack_encode(json, &mp) == 0);
+    CHECK((unsigned char)mp.buf[0] == 0xdc);
+    r = sjson_msgpack_decode(mp.buf, mp.len, NULL);
+    out = dump(r.json);
+    CHECKSTR(out, src.buf);
+    free(out);
+    sjson_free(r.json);
+    sjson_free(json);
+    free(mp.buf);
+    free(src.buf);
+}
+
+int main(void) {
+    sjson *json = parse("{\"name\":\"sjson\",\"tags\":[\"json\",\"c\"],"
+                        "\"version\":3,\"stable\":false}");
+    describe(json, 0);
+    sjson_free(json);
+
+    test_arena();
+    test_parser();
+    test_zerocopy();
+    test_structural();
+    test_numbers();
+    test_serialize();
+    test_dtoa();
+    test_object_index();
+    test_array_index();
+    test_pull();
+    test_lines();
+    test_file();
+    test_lazy();
+    test_query();
+    test_tape();
+    test_compact();
+    test_intern();
+    test_escape();
+    test_utf8();
+    test_depth();
+    test_parallel();
+    test_cached();
+    test_context();
+    test_writer();
+    test_msgpack();
+
+    printf("%d checks, %d failed\n", checked, failed);
+    return failed != 0;
+}